@@ -14,26 +14,349 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
+#include <linux/async.h>
 #include <linux/backlight.h>
 #include <linux/acpi.h>
 #include <linux/pnp.h>
+#include <linux/platform_device.h>
+#include <linux/power_supply.h>
+#include <linux/notifier.h>
 #include <linux/pci.h>
 #include <linux/vga_switcheroo.h>
 
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/slab.h>
+#include <linux/pm_runtime.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+
+#define CREATE_TRACE_POINTS
+#include "apple_gmux_trace.h"
 
-static struct apple_gmux_data {
+/*
+ * Power state of the discrete GPU. A transition is started by writing
+ * GMUX_PORT_DISCRETE_POWER and finishes when the gmux raises
+ * GMUX_INTERRUPT_STATUS_POWER.
+ */
+enum gmux_power_state {
+	GMUX_POWER_OFF,
+	GMUX_POWER_POWERING_UP,
+	GMUX_POWER_ON,
+	GMUX_POWER_POWERING_DOWN,
+};
+
+/* Operations with a latency histogram in debugfs */
+enum gmux_lat_op {
+	GMUX_LAT_SWITCH,
+	GMUX_LAT_POWER_UP,
+	GMUX_LAT_POWER_DOWN,
+	GMUX_LAT_BRIGHTNESS,
+	GMUX_LAT_NR,
+};
+
+/* bucket n counts latencies of 2^n to 2^(n+1) us, the last one is open */
+#define GMUX_LAT_BUCKETS	20
+
+struct gmux_lat_hist {
+	u64 count;
+	u64 total_us;
+	u64 max_us;
+	u64 buckets[GMUX_LAT_BUCKETS];
+};
+
+/* Port access and event counters, shown in debugfs */
+struct gmux_stats {
+	atomic_t reads;
+	atomic_t writes;
+	atomic_t irqs[8];		/* one per interrupt status bit */
+	atomic_t power_timeouts;
+	atomic_t pwrd_failures;
+	atomic_t mux_writes_skipped;
+	atomic_t power_downs_deferred;
+	atomic_t power_cycles_avoided;
+	atomic_t irqs_coalesced;
+	atomic_t irq_storms;
+	atomic_t xfer_errors;
+	atomic_t bl_superseded;
+};
+
+struct gmux_port_ops;
+struct gmux_emu;
+struct apple_gmux_data;
+
+/* Read-back values of the mux and power ports */
+struct gmux_snapshot {
+	u8 display;		/* GMUX_PORT_SWITCH_GET_DISPLAY */
+	u8 ddc;			/* GMUX_PORT_SWITCH_DDC */
+	u8 external;		/* GMUX_PORT_SWITCH_GET_EXTERNAL */
+	u8 power;		/* GMUX_PORT_DISCRETE_POWER */
+	u32 brightness;		/* GMUX_PORT_BRIGHTNESS */
+};
+
+/*
+ * Measured durations of the last GMUX_POWER_SAMPLES power transitions in
+ * one direction, the power timeout is derived from these.
+ */
+#define GMUX_POWER_SAMPLES	64
+
+struct gmux_power_profile {
+	u32 us[GMUX_POWER_SAMPLES];
+	unsigned int count;	/* transitions recorded since probe */
+	u32 p50_us;
+	u32 p99_us;
+	unsigned int timeout_ms;
+};
+
+/* State kept for every discrete GPU seen by gmux_get_client_id() */
+struct gmux_gpu {
+	struct list_head list;
+	struct apple_gmux_data *gmux_data;
+	/* pdev is NULL for the GPU of an emulated gmux */
+	struct pci_dev *pdev;
+	struct device *dev;
+
+	/* PWRD method of the GPU and its argument, looked up once */
+	bool pwrd_probed;
+	acpi_handle pwrd_handle;
+	union acpi_object pwrd_arg;
+	struct acpi_object_list pwrd_args;
+
+	/* runtime PM for the GPU, see gmux_setup_runtime_pm() */
+	struct dev_pm_domain pm_domain;
+	bool runtime_pm;
+
+	/* serializes power transitions and GMUX_PORT_DISCRETE_POWER */
+	struct mutex power_mutex;
+	/* protects power_state, waiters sleep on power_waitq */
+	spinlock_t power_lock;
+	enum gmux_power_state power_state;
+	ktime_t power_start;
+	/* jiffies when the last transition started, for the min on/off time */
+	unsigned long power_changed;
+	/* power down held back by gmux_request_discrete_state() */
+	struct delayed_work power_down_work;
+	/* interrupt to completion of the last power change, -1 if none */
+	s64 power_irq_us;
+	wait_queue_head_t power_waitq;
+	/* power downs and ups, under power_lock */
+	struct gmux_power_profile power_profile[2];
+	/* the last transition was completed by its timeout */
+	bool power_timed_out;
+};
+
+struct apple_gmux_data {
 	unsigned long iostart;
 	unsigned long iolen;
 	acpi_handle dhandle;
-	enum vga_switcheroo_client_id resume_client_id;
+	/* setup left to gmux_probe_async() */
+	async_cookie_t async_cookie;
+	/* hardware state saved by gmux_suspend() for gmux_resume() */
+	struct gmux_snapshot resume_state;
+
+	u32 version;
+	/* port access backend, picked from the version at probe time */
+	const struct gmux_port_ops *ops;
 
 	struct backlight_device *bdev;
-} gmux_data;
 
-static struct pci_dev *discrete;
+	/*
+	 * Coalesced brightness writes, see gmux_update_status(). bl_lock
+	 * also covers the brightness ports, a legacy write takes four port
+	 * accesses that must not be interleaved with a read. It is taken
+	 * from the ramp hrtimer, so interrupts must be disabled.
+	 */
+	spinlock_t bl_lock;
+	u32 bl_pending;
+	bool bl_dirty;
+	/* last brightness written, resynced from hardware when stale */
+	u32 bl_shadow;
+	bool bl_stale;
+	unsigned long bl_last_flush;
+	struct delayed_work bl_work;
+
+	/* brightness ramp, see gmux_start_ramp() */
+	struct hrtimer bl_ramp_timer;
+	u32 bl_ramp_from;
+	u32 bl_ramp_to;
+	ktime_t bl_ramp_start;
+	s64 bl_ramp_ns;
+
+	/* all discrete GPUs, the one behind the gmux is also in discrete */
+	struct list_head gpus;
+	struct gmux_gpu *discrete;
+
+	/* ordered queue for switch and power stages */
+	struct workqueue_struct *wq;
+	atomic_t stages_pending;
+	wait_queue_head_t switch_waitq;
+	/*
+	 * sequence numbers of the last queued and last finished stage,
+	 * stage_lock keeps them in the order stages are queued
+	 */
+	spinlock_t stage_lock;
+	atomic_t stage_seq;
+	atomic_t stage_done_seq;
+
+	/* protects the display, DDC and external muxes and the fields below */
+	struct mutex mux_lock;
+	/* last read-back value of each mux, re-read when mux_stale is set */
+	u8 display_shadow;
+	u8 ddc_shadow;
+	u8 external_shadow;
+	bool mux_stale;
+	/* set by gmux_prepare(), DDC is already routed to prepared_id */
+	bool prepared;
+	enum vga_switcheroo_client_id prepared_id;
+
+	/* switch policy state, see gmux_policy_work_func() */
+	struct mutex policy_lock;
+	struct delayed_work policy_work;
+	struct notifier_block policy_nb;
+	bool policy_running;
+	bool policy_valid;
+	enum vga_switcheroo_client_id policy_want;
+	unsigned long policy_changed;
+	bool policy_busy;
+	unsigned long policy_idle_since;
+
+	/* interrupt ports and status latched for the bottom half */
+	spinlock_t irq_lock;
+	int irq_status;
+	ktime_t irq_time;
+	struct delayed_work irq_work;
+
+	/* GMUX_PORT_INTERRUPT_ENABLE, see gmux_irq_program() */
+	bool irq_enabled;
+	int irq_mask;
+	unsigned int irq_refs[8];
+
+	/* interrupt storm detection, see gmux_notify_handler() */
+	unsigned long irq_window;
+	unsigned int irq_count;
+	bool irq_polling;
+	unsigned int irq_quiet_ms;
+	struct delayed_work irq_poll_work;
+
+	/* latency histograms, protected by lat_lock */
+	spinlock_t lat_lock;
+	struct gmux_lat_hist lat[GMUX_LAT_NR];
+	struct gmux_stats stats;
+	struct dentry *debugfs;
+
+	/* result of the last debugfs benchmark run, protected by bench_lock */
+	struct mutex bench_lock;
+	char bench_result[512];
+
+	struct device *dev;
+	/* set when the gmux is emulated, see gmux_emu_probe() */
+	struct gmux_emu *emu;
+};
 
-DECLARE_COMPLETION(powerchange_done);
+/* the gmux registered with vga_switcheroo, which has no context pointer */
+static struct apple_gmux_data *apple_gmux_data;
+
+static struct dentry *gmux_debugfs_root;
+
+static unsigned int brightness_interval = 16;
+module_param(brightness_interval, uint, 0644);
+MODULE_PARM_DESC(brightness_interval,
+		 "Minimum time in ms between two brightness writes to the "
+		 "gmux, requests in between are coalesced (default: 16)");
+
+static int wide_io = -1;
+module_param(wide_io, int, 0444);
+MODULE_PARM_DESC(wide_io,
+		 "Use single 32-bit port writes: -1 = decide from the gmux "
+		 "version, 0 = never, 1 = always (default: -1)");
+
+static int hotplug_route = 1;
+module_param(hotplug_route, int, 0644);
+MODULE_PARM_DESC(hotplug_route,
+		 "Route the external port on hotplug: 0 = leave it alone, "
+		 "1 = follow the GPU driving the panel, 2 = discrete GPU "
+		 "(default: 1)");
+
+static int dgpu_autosuspend_delay = 5000;
+module_param(dgpu_autosuspend_delay, int, 0444);
+MODULE_PARM_DESC(dgpu_autosuspend_delay,
+		 "Idle time in ms before the discrete GPU is powered down "
+		 "by runtime PM, -1 to disable (default: 5000)");
+
+static unsigned int power_min_on_ms = 1000;
+module_param(power_min_on_ms, uint, 0644);
+MODULE_PARM_DESC(power_min_on_ms,
+		 "Minimum time in ms the discrete GPU stays on after a power "
+		 "up, earlier power downs are deferred (default: 1000)");
+
+static unsigned int power_min_off_ms;
+module_param(power_min_off_ms, uint, 0644);
+MODULE_PARM_DESC(power_min_off_ms,
+		 "Minimum time in ms the discrete GPU stays off after a power "
+		 "down before it is powered up again (default: 0)");
+
+static int policy;
+module_param(policy, int, 0444);
+MODULE_PARM_DESC(policy,
+		 "Switch policy: 0 = manual, 1 = power the discrete GPU and "
+		 "recommend a GPU to userspace automatically (default: 0)");
+
+static unsigned int policy_idle_ms = 10000;
+module_param(policy_idle_ms, uint, 0644);
+MODULE_PARM_DESC(policy_idle_ms,
+		 "Idle time in ms of the discrete GPU on battery before the "
+		 "policy falls back to IGD (default: 10000)");
+
+static unsigned int power_timeout_ms;
+module_param(power_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(power_timeout_ms,
+		 "Time in ms to wait for the gmux to finish a power change, "
+		 "0 = adapt to the measured power times (default: 0)");
+
+static unsigned int policy_hysteresis_ms = 30000;
+module_param(policy_hysteresis_ms, uint, 0644);
+MODULE_PARM_DESC(policy_hysteresis_ms,
+		 "Minimum time in ms between two policy recommendations "
+		 "(default: 30000)");
+
+static unsigned int irq_coalesce_ms = 5;
+module_param(irq_coalesce_ms, uint, 0644);
+MODULE_PARM_DESC(irq_coalesce_ms,
+		 "Time in ms display and hotplug interrupts are collected "
+		 "before they are handled together (default: 5)");
+
+static unsigned int irq_storm_threshold = 50;
+module_param(irq_storm_threshold, uint, 0644);
+MODULE_PARM_DESC(irq_storm_threshold,
+		 "Interrupts per second after which the gmux is polled "
+		 "instead, 0 to disable (default: 50)");
+
+static bool emulate;
+module_param(emulate, bool, 0444);
+MODULE_PARM_DESC(emulate,
+		 "Register an emulated gmux in addition to any real one, for "
+		 "testing without Apple hardware (default: 0)");
+
+static unsigned int emulate_power_delay = 50;
+module_param(emulate_power_delay, uint, 0644);
+MODULE_PARM_DESC(emulate_power_delay,
+		 "Time in ms a power change of the emulated gmux takes "
+		 "(default: 50)");
+
+static int emulate_irq = 1;
+module_param(emulate_irq, int, 0644);
+MODULE_PARM_DESC(emulate_irq,
+		 "Interrupts of the emulated gmux: 0 = never raised, "
+		 "1 = raised, 2 = all but the power interrupt (default: 1)");
 
 /*
  * gmux port offsets. Many of these are not yet used, but may be in the
@@ -63,380 +386,2990 @@ DECLARE_COMPLETION(powerchange_done);
 #define GMUX_INTERRUPT_STATUS_POWER	(1 << 2)
 #define GMUX_INTERRUPT_STATUS_HOTPLUG	(1 << 3)
 
+#define GMUX_VERSION(major, minor, release) \
+	(((major) << 16) | ((minor) << 8) | (release))
+
+/*
+ * First gmux version assumed to take single 32-bit port writes. All gmux
+ * versions seen so far are older and known to work with the byte-wise
+ * sequence, so this is deliberately conservative. The wide_io module
+ * parameter can be used to try other versions.
+ */
+#define GMUX_VERSION_WIDE_IO		GMUX_VERSION(2, 0, 0)
+
 #define GMUX_BRIGHTNESS_MASK		0x00ffffff
 #define GMUX_MAX_BRIGHTNESS		GMUX_BRIGHTNESS_MASK
 
-static inline u8 gmux_read8(int port)
+/*
+ * Upper bound for the gmux to signal a finished power transition, until
+ * GMUX_POWER_MIN_SAMPLES transitions have been measured. After that the
+ * timeout is the measured p99 plus a quarter and GMUX_POWER_MARGIN_MS,
+ * capped at GMUX_POWER_TIMEOUT_MAX_MS.
+ */
+#define GMUX_POWER_TIMEOUT_MS		200
+#define GMUX_POWER_MIN_SAMPLES		8
+#define GMUX_POWER_MARGIN_MS		20
+#define GMUX_POWER_TIMEOUT_MAX_MS	2000
+
+/*
+ * During an interrupt storm the status port is polled every
+ * GMUX_IRQ_POLL_MS, interrupts are enabled again once it has been quiet
+ * for GMUX_IRQ_QUIET_MS.
+ */
+#define GMUX_IRQ_POLL_MS		100
+#define GMUX_IRQ_QUIET_MS		5000
+
+/*
+ * Debug output is grouped by a category prefix, which dynamic debug can
+ * match on, e.g. 'format "power:" +p'. Nothing is printed by default, the
+ * same events are also available as tracepoints.
+ */
+#define gmux_dbg(cat, fmt, ...)	pr_debug(cat ": " fmt, ##__VA_ARGS__)
+#define gmux_dev_dbg(dev, cat, fmt, ...) \
+	dev_dbg(dev, cat ": " fmt, ##__VA_ARGS__)
+
+/*
+ * Port access backends. Newer gmux versions take 32-bit values in a
+ * single write, older ones need them written out byte by byte with the
+ * upper byte written last to flush them. Which backend is used is
+ * decided once in gmux_probe().
+ */
+struct gmux_port_ops {
+	const char *name;
+	u8 (*read8)(struct apple_gmux_data *gmux_data, int port);
+	void (*write8)(struct apple_gmux_data *gmux_data, int port, u8 val);
+	u32 (*read32)(struct apple_gmux_data *gmux_data, int port);
+	void (*write32)(struct apple_gmux_data *gmux_data, int port, u32 val);
+	/*
+	 * Brightness bits the backend can write. The byte-wise sequence
+	 * needs the upper byte written as 0 to flush the value.
+	 */
+	u32 brightness_mask;
+};
+
+static u8 gmux_pio_read8(struct apple_gmux_data *gmux_data, int port)
 {
-	return inb(gmux_data.iostart + port);
+	return inb(gmux_data->iostart + port);
 }
 
-static inline void gmux_write8(int port, u8 val)
+static void gmux_pio_write8(struct apple_gmux_data *gmux_data, int port,
+			    u8 val)
 {
-	outb(val, gmux_data.iostart + port);
+	outb(val, gmux_data->iostart + port);
 }
 
-static inline u32 gmux_read32(int port)
+static u32 gmux_pio_read32(struct apple_gmux_data *gmux_data, int port)
 {
-	return inl(gmux_data.iostart + port);
+	return inl(gmux_data->iostart + port);
 }
 
-static int gmux_get_brightness(struct backlight_device *bd)
+static void gmux_pio_write32(struct apple_gmux_data *gmux_data, int port,
+			     u32 val)
 {
-	return gmux_read32(GMUX_PORT_BRIGHTNESS) &
-	       GMUX_BRIGHTNESS_MASK;
+	outl(val, gmux_data->iostart + port);
 }
 
-static int gmux_update_status(struct backlight_device *bd)
+static void gmux_legacy_write32(struct apple_gmux_data *gmux_data, int port,
+				u32 val)
 {
-	u32 brightness = bd->props.brightness;
+	gmux_pio_write8(gmux_data, port, val);
+	gmux_pio_write8(gmux_data, port + 1, val >> 8);
+	gmux_pio_write8(gmux_data, port + 2, val >> 16);
+	gmux_pio_write8(gmux_data, port + 3, val >> 24);
+}
 
-	/*
-	 * Older gmux versions require writing out lower bytes first then
-	 * setting the upper byte to 0 to flush the values. Newer versions
-	 * accept a single u32 write, but the old method also works, so we
-	 * just use the old method for all gmux versions.
-	 */
-	gmux_write8(GMUX_PORT_BRIGHTNESS, brightness);
-	gmux_write8(GMUX_PORT_BRIGHTNESS + 1, brightness >> 8);
-	gmux_write8(GMUX_PORT_BRIGHTNESS + 2, brightness >> 16);
-	gmux_write8(GMUX_PORT_BRIGHTNESS + 3, 0);
+static const struct gmux_port_ops gmux_legacy_ops = {
+	.name = "legacy",
+	.read8 = gmux_pio_read8,
+	.write8 = gmux_pio_write8,
+	.read32 = gmux_pio_read32,
+	.write32 = gmux_legacy_write32,
+	.brightness_mask = GMUX_BRIGHTNESS_MASK,
+};
 
-	return 0;
+static const struct gmux_port_ops gmux_wide_ops = {
+	.name = "wide",
+	.read8 = gmux_pio_read8,
+	.write8 = gmux_pio_write8,
+	.read32 = gmux_pio_read32,
+	.write32 = gmux_pio_write32,
+	.brightness_mask = 0xffffffff,
+};
+
+static inline u8 gmux_read8(struct apple_gmux_data *gmux_data, int port)
+{
+	u8 val = gmux_data->ops->read8(gmux_data, port);
+
+	atomic_inc(&gmux_data->stats.reads);
+	trace_gmux_port_read(port, val, 8);
+	return val;
 }
 
-static int gmux_switchto(enum vga_switcheroo_client_id id)
+static inline void gmux_write8(struct apple_gmux_data *gmux_data, int port,
+			       u8 val)
 {
-	u8 active_card;
+	atomic_inc(&gmux_data->stats.writes);
+	trace_gmux_port_write(port, val, 8);
+	gmux_data->ops->write8(gmux_data, port, val);
+}
 
-	/* TODO: check this out */
-	active_card = gmux_read8(GMUX_PORT_SWITCH_GET_DISPLAY);
-	pr_info("active card before: %x\n", active_card);
+static inline u32 gmux_read32(struct apple_gmux_data *gmux_data, int port)
+{
+	u32 val = gmux_data->ops->read32(gmux_data, port);
 
-	if (id == VGA_SWITCHEROO_IGD) {
-		gmux_write8(GMUX_PORT_SWITCH_DDC, 1);
-		gmux_write8(GMUX_PORT_SWITCH_DISPLAY, 2);
-		gmux_write8(GMUX_PORT_SWITCH_EXTERNAL, 2);
-	} else {
-		gmux_write8(GMUX_PORT_SWITCH_DDC, 2);
-		gmux_write8(GMUX_PORT_SWITCH_DISPLAY, 3);
-		gmux_write8(GMUX_PORT_SWITCH_EXTERNAL, 3);
-	}
+	atomic_inc(&gmux_data->stats.reads);
+	trace_gmux_port_read(port, val, 32);
+	return val;
+}
 
-	/* TODO: check this out */
-	active_card = gmux_read8(GMUX_PORT_SWITCH_GET_DISPLAY);
-	pr_info("active card after: %x\n", active_card);
+static inline void gmux_write32(struct apple_gmux_data *gmux_data, int port,
+				u32 val)
+{
+	atomic_inc(&gmux_data->stats.writes);
+	trace_gmux_port_write(port, val, 32);
+	gmux_data->ops->write32(gmux_data, port, val);
+}
 
+/*
+ * Port transactions. A hardware sequence is described as an array of
+ * gmux_xfer_op and run back to back by gmux_xfer(). The caller holds
+ * whatever lock covers the ports involved, so the whole sequence runs
+ * under a single acquisition. EXPECT ops read a port back and end the
+ * transaction if it doesn't hold the expected value.
+ */
+enum gmux_xfer_type {
+	GMUX_XFER_READ,
+	GMUX_XFER_WRITE,
+	GMUX_XFER_EXPECT,
+};
 
+struct gmux_xfer_op {
+	u8 type;
+	u8 width;		/* 8 or 32 bits */
+	u8 port;
+	u32 val;		/* written, or expected by EXPECT */
+	u32 result;		/* read by READ and EXPECT */
+};
 
-	return 0;
-}
+#define GMUX_XFER_R8(p)		{ GMUX_XFER_READ, 8, (p), 0, 0 }
+#define GMUX_XFER_R32(p)	{ GMUX_XFER_READ, 32, (p), 0, 0 }
+#define GMUX_XFER_W8(p, v)	{ GMUX_XFER_WRITE, 8, (p), (v), 0 }
+#define GMUX_XFER_W32(p, v)	{ GMUX_XFER_WRITE, 32, (p), (v), 0 }
+#define GMUX_XFER_EXPECT8(p, v)	{ GMUX_XFER_EXPECT, 8, (p), (v), 0 }
 
-static int gmux_switchddc(enum vga_switcheroo_client_id id)
+/*
+ * Run the @nr ops of @xfer. Returns 0, or -EIO if an EXPECT op read back
+ * something else, in which case the ops after it are not run. The time
+ * taken is reported through the gmux_xfer tracepoint.
+ */
+static int gmux_xfer(struct apple_gmux_data *gmux_data, const char *name,
+		     struct gmux_xfer_op *xfer, int nr)
 {
-	if (id == VGA_SWITCHEROO_IGD) {
-		pr_info("switch ddc to IGD\n");
-		gmux_write8(GMUX_PORT_SWITCH_DDC, 1);
-	} else {
-		pr_info("switch ddc to DIS\n");
-		gmux_write8(GMUX_PORT_SWITCH_DDC, 2);
+	ktime_t start = ktime_get();
+	int i, ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		struct gmux_xfer_op *op = &xfer[i];
+
+		if (op->type == GMUX_XFER_WRITE) {
+			if (op->width == 32)
+				gmux_write32(gmux_data, op->port, op->val);
+			else
+				gmux_write8(gmux_data, op->port, op->val);
+			continue;
+		}
+
+		op->result = op->width == 32 ?
+			gmux_read32(gmux_data, op->port) :
+			gmux_read8(gmux_data, op->port);
+		if (op->type == GMUX_XFER_EXPECT && op->result != op->val) {
+			gmux_dbg("io", "%s: port %#x reads %#x, expected %#x\n",
+				 name, op->port, op->result, op->val);
+			atomic_inc(&gmux_data->stats.xfer_errors);
+			ret = -EIO;
+			break;
+		}
 	}
 
-	return 0;
+	trace_gmux_xfer(name, i, ret, ktime_to_ns(ktime_sub(ktime_get(),
+							    start)));
+	return ret;
 }
 
-static int gmux_call_acpi_pwrd(int arg)
+/* Account the time since @start to the histogram of @op */
+static s64 gmux_lat_record(struct apple_gmux_data *gmux_data,
+			   enum gmux_lat_op op, ktime_t start)
 {
-	acpi_handle gfx_handle;
-	acpi_handle pwrd_handle = NULL;
-	acpi_status status = AE_OK;
-	struct acpi_buffer buffer = { ACPI_ALLOCATE_BUFFER, NULL };
-	union acpi_object arg0 = { ACPI_TYPE_INTEGER };
-	struct acpi_object_list arg_list = { 1, &arg0 };
-
-	/*gfx_handle = acpi_get_child(DEVICE_ACPI_HANDLE(&discrete->dev), 0);*/
-	gfx_handle = DEVICE_ACPI_HANDLE(&discrete->dev);
-	pr_info("gfx_handle: %x\n", gfx_handle);
-	status = acpi_get_handle(gfx_handle, "PWRD", &pwrd_handle);
-	if (ACPI_FAILURE(status)) {
-		pr_err("Cannot get PWRD handle: %s\n", acpi_format_exception(status));
-		return -ENODEV;
-	}
+	struct gmux_lat_hist *hist = &gmux_data->lat[op];
+	s64 us = ktime_us_delta(ktime_get(), start);
+	unsigned long flags;
+	int bucket;
+
+	if (us < 0)
+		us = 0;
+	bucket = us < 2 ? 0 : min_t(int, ilog2(us), GMUX_LAT_BUCKETS - 1);
+
+	spin_lock_irqsave(&gmux_data->lat_lock, flags);
+	hist->count++;
+	hist->total_us += us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+	hist->buckets[bucket]++;
+	spin_unlock_irqrestore(&gmux_data->lat_lock, flags);
+
+	return us;
+}
 
-	arg0.integer.value = arg;
+static u32 gmux_read_brightness(struct apple_gmux_data *gmux_data)
+{
+	lockdep_assert_held(&gmux_data->bl_lock);
+	return gmux_read32(gmux_data, GMUX_PORT_BRIGHTNESS) &
+	       gmux_data->ops->brightness_mask;
+}
 
-	status = acpi_evaluate_object(pwrd_handle, NULL, &arg_list, &buffer);
-	if (ACPI_FAILURE(status)) {
-		pr_err("PWRD call failed: %s\n", acpi_format_exception(status));
-		return -ENODEV;
+/*
+ * The brightness is polled a lot through sysfs, so answer from the shadow
+ * copy of what was last requested. The hardware is only read again after
+ * something may have changed it behind our back, see
+ * gmux_brightness_invalidate().
+ */
+static int gmux_get_brightness(struct backlight_device *bd)
+{
+	struct apple_gmux_data *gmux_data = bl_get_data(bd);
+	u32 brightness;
+
+	spin_lock_irq(&gmux_data->bl_lock);
+	if (gmux_data->bl_stale && !gmux_data->bl_dirty) {
+		gmux_data->bl_shadow = gmux_read_brightness(gmux_data);
+		gmux_data->bl_stale = false;
 	}
+	brightness = gmux_data->bl_shadow;
+	spin_unlock_irq(&gmux_data->bl_lock);
 
-	//acpi_result_to_string(buffer.pointer);
-	kfree(buffer.pointer);
+	return brightness;
+}
 
-	pr_info("PWRD call successful\n");
-	return 0;
+static void gmux_brightness_invalidate(struct apple_gmux_data *gmux_data)
+{
+	spin_lock_irq(&gmux_data->bl_lock);
+	gmux_data->bl_stale = true;
+	spin_unlock_irq(&gmux_data->bl_lock);
+}
+
+static void gmux_write_brightness(struct apple_gmux_data *gmux_data,
+				  u32 brightness)
+{
+	ktime_t start = ktime_get();
+	struct gmux_xfer_op xfer[] = {
+		GMUX_XFER_W32(GMUX_PORT_BRIGHTNESS,
+			      brightness & gmux_data->ops->brightness_mask),
+	};
+
+	lockdep_assert_held(&gmux_data->bl_lock);
+	gmux_xfer(gmux_data, "brightness", xfer, ARRAY_SIZE(xfer));
+	gmux_dbg("backlight", "brightness %u\n", brightness);
+	gmux_lat_record(gmux_data, GMUX_LAT_BRIGHTNESS, start);
 }
 
-static int gmux_set_discrete_state(enum vga_switcheroo_state state)
+static void gmux_brightness_work_func(struct work_struct *work)
 {
-	/* TODO: locking for completions needed? */
-	init_completion(&powerchange_done);
+	struct apple_gmux_data *gmux_data =
+		container_of(work, struct apple_gmux_data, bl_work.work);
 
-	if (state == VGA_SWITCHEROO_ON) {
-		gmux_call_acpi_pwrd(0);
-		gmux_write8(GMUX_PORT_DISCRETE_POWER, 1);
-		gmux_write8(GMUX_PORT_DISCRETE_POWER, 3);
-		pr_info("discrete card powered up\n");
-	} else {
-		gmux_write8(GMUX_PORT_DISCRETE_POWER, 1);
-		gmux_write8(GMUX_PORT_DISCRETE_POWER, 0);
-		gmux_call_acpi_pwrd(1);
-		pr_info("discrete card powered down\n");
+	spin_lock_irq(&gmux_data->bl_lock);
+	if (!gmux_data->bl_dirty) {
+		spin_unlock_irq(&gmux_data->bl_lock);
+		return;
 	}
+	gmux_data->bl_dirty = false;
+	gmux_write_brightness(gmux_data, gmux_data->bl_pending);
+	gmux_data->bl_last_flush = jiffies;
+	spin_unlock_irq(&gmux_data->bl_lock);
+}
 
-	if (wait_for_completion_interruptible_timeout(&powerchange_done, msecs_to_jiffies(200)))
-		pr_info("completion timeout\n");
+/*
+ * Brightness ramps. Userspace gives a target and a duration through the
+ * brightness_ramp sysfs attribute and an hrtimer steps the brightness
+ * there every brightness_interval ms. Perceived brightness isn't linear in
+ * the PWM duty cycle, so the steps are evenly spaced on a square root
+ * scale: small at the dark end and larger towards full brightness.
+ */
+#define GMUX_RAMP_MAX_MS	60000
 
-	return 0;
+static u32 gmux_ramp_value(u32 from, u32 to, s64 elapsed, s64 total)
+{
+	/* scale the square roots by 8 while that can't overflow */
+	int shift = max(from, to) <= GMUX_BRIGHTNESS_MASK ? 6 : 0;
+	u32 sfrom = int_sqrt((unsigned long)from << shift);
+	u32 sto = int_sqrt((unsigned long)to << shift);
+	u32 frac;
+	u64 v;
+
+	frac = div64_u64((u64)elapsed << 16, total);
+	v = ((u64)sfrom * (65536 - frac) + (u64)sto * frac) >> 16;
+
+	return (v * v) >> shift;
 }
 
-static int gmux_set_power_state(enum vga_switcheroo_client_id id,
-				enum vga_switcheroo_state state)
+static enum hrtimer_restart gmux_ramp_timer_func(struct hrtimer *timer)
 {
-	if (id == VGA_SWITCHEROO_IGD)
-		return 0;
-
-	return gmux_set_discrete_state(state);
+	struct apple_gmux_data *gmux_data =
+		container_of(timer, struct apple_gmux_data, bl_ramp_timer);
+	s64 elapsed = ktime_to_ns(ktime_sub(ktime_get(),
+					    gmux_data->bl_ramp_start));
+	bool done = elapsed >= gmux_data->bl_ramp_ns;
+	unsigned long flags;
+	u32 val;
+
+	val = done ? gmux_data->bl_ramp_to :
+		     gmux_ramp_value(gmux_data->bl_ramp_from,
+				     gmux_data->bl_ramp_to, elapsed,
+				     gmux_data->bl_ramp_ns);
+
+	spin_lock_irqsave(&gmux_data->bl_lock, flags);
+	if (val != gmux_data->bl_shadow || done)
+		gmux_write_brightness(gmux_data, val);
+	gmux_data->bl_shadow = val;
+	gmux_data->bl_stale = false;
+	gmux_data->bl_last_flush = jiffies;
+	spin_unlock_irqrestore(&gmux_data->bl_lock, flags);
+
+	if (done)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ktime_set(0, max(brightness_interval, 1U) *
+						  NSEC_PER_MSEC));
+	return HRTIMER_RESTART;
 }
 
-static int gmux_init(void)
+/* Stop a running ramp, leaving the brightness where it got to */
+static void gmux_stop_ramp(struct apple_gmux_data *gmux_data)
 {
-	return 0;
+	hrtimer_cancel(&gmux_data->bl_ramp_timer);
 }
 
-static int gmux_get_client_id(struct pci_dev *pdev)
+static int gmux_start_ramp(struct apple_gmux_data *gmux_data, u32 target,
+			   unsigned int duration_ms)
 {
-	pr_info("get client id rom shadow: %x %d", pdev->vendor, pdev->resource[PCI_ROM_RESOURCE].flags & IORESOURCE_ROM_SHADOW);
-	if (pdev->vendor == PCI_VENDOR_ID_INTEL) {
-		pdev->resource[PCI_ROM_RESOURCE].flags &= ~IORESOURCE_ROM_SHADOW;
-		dev_printk(KERN_DEBUG, &pdev->dev, "not boot video device\n");
-	} else {
-		pdev->resource[PCI_ROM_RESOURCE].flags |= IORESOURCE_ROM_SHADOW;
-		dev_printk(KERN_DEBUG, &pdev->dev, "boot video device\n");
-	}
+	struct backlight_device *bd = gmux_data->bdev;
 
-	/* early mbps with switchable graphics use nvidia integrated graphics,
-	 * hardcode that the 9400M is integrated */
-	if (pdev->vendor == PCI_VENDOR_ID_INTEL) {
-		return VGA_SWITCHEROO_IGD;
-	} else if (pdev->vendor == PCI_VENDOR_ID_NVIDIA && pdev->device == 0x0863) {
-		return VGA_SWITCHEROO_IGD;
-	} else {
-		discrete = pdev;
-		return VGA_SWITCHEROO_DIS;
+	if (target > bd->props.max_brightness || duration_ms > GMUX_RAMP_MAX_MS)
+		return -EINVAL;
+
+	gmux_stop_ramp(gmux_data);
+	/* reads of the brightness already report where the ramp ends */
+	bd->props.brightness = target;
+
+	spin_lock_irq(&gmux_data->bl_lock);
+	/* the ramp supersedes any coalesced write */
+	gmux_data->bl_dirty = false;
+	if (gmux_data->bl_stale) {
+		gmux_data->bl_shadow = gmux_read_brightness(gmux_data);
+		gmux_data->bl_stale = false;
 	}
+	gmux_data->bl_ramp_from = gmux_data->bl_shadow;
+	gmux_data->bl_ramp_to = target;
+	gmux_data->bl_ramp_ns = (s64)duration_ms * NSEC_PER_MSEC;
+	gmux_data->bl_ramp_start = ktime_get();
+	spin_unlock_irq(&gmux_data->bl_lock);
+
+	hrtimer_start(&gmux_data->bl_ramp_timer, ktime_set(0, 0),
+		      HRTIMER_MODE_REL);
+	return 0;
 }
 
-static struct vga_switcheroo_handler gmux_handler = {
-	.switchto = gmux_switchto,
-	.switchddc = gmux_switchddc,
-	.power_state = gmux_set_power_state,
-	.init = gmux_init,
-	.get_client_id = gmux_get_client_id,
-};
+/*
+ * Brightness animations can change the brightness much faster than the
+ * panel can follow, and each write costs several slow port accesses. Only
+ * remember the latest value here and write it out at most once every
+ * brightness_interval ms, values superseded in between are dropped.
+ */
+static int gmux_update_status(struct backlight_device *bd)
+{
+	struct apple_gmux_data *gmux_data = bl_get_data(bd);
+	unsigned long next, now = jiffies;
+	unsigned long delay = 0;
+
+	/* an explicit brightness wins over a ramp in progress */
+	gmux_stop_ramp(gmux_data);
+
+	spin_lock_irq(&gmux_data->bl_lock);
+	if (gmux_data->bl_dirty)
+		atomic_inc(&gmux_data->stats.bl_superseded);
+	gmux_data->bl_pending = bd->props.brightness;
+	gmux_data->bl_shadow = bd->props.brightness;
+	gmux_data->bl_dirty = true;
+	spin_unlock_irq(&gmux_data->bl_lock);
+
+	next = gmux_data->bl_last_flush + msecs_to_jiffies(brightness_interval);
+	if (time_after(next, now))
+		delay = next - now;
+
+	schedule_delayed_work(&gmux_data->bl_work, delay);
+	return 0;
+}
 
-static void gmux_disable_interrupts(void)
+static void gmux_uevent(struct apple_gmux_data *gmux_data, const char *event,
+			const char *var)
 {
-	gmux_write8(GMUX_PORT_INTERRUPT_ENABLE, GMUX_INTERRUPT_DISABLE);
+	char event_env[32];
+	char *envp[] = { event_env, (char *)var, NULL };
+
+	snprintf(event_env, sizeof(event_env), "GMUX_EVENT=%s", event);
+	kobject_uevent_env(&gmux_data->dev->kobj, KOBJ_CHANGE, envp);
 }
 
-static void gmux_enable_interrupts(void)
+/*
+ * Every GPE costs the CPU a wakeup, so the gmux only raises the interrupts
+ * something is waiting for: power while a transition is pending and
+ * display while a switch is in progress. Hotplug comes from outside and
+ * stays enabled. Users take a reference on the status bits they need with
+ * gmux_irq_get().
+ */
+#define GMUX_INTERRUPT_IDLE_MASK	GMUX_INTERRUPT_STATUS_HOTPLUG
+
+static void gmux_irq_program(struct apple_gmux_data *gmux_data)
 {
-	gmux_write8(GMUX_PORT_INTERRUPT_ENABLE, GMUX_INTERRUPT_ENABLE);
+	int mask = GMUX_INTERRUPT_DISABLE;
+	int i;
+
+	lockdep_assert_held(&gmux_data->irq_lock);
+	if (gmux_data->irq_enabled && !gmux_data->irq_polling) {
+		mask = GMUX_INTERRUPT_IDLE_MASK;
+		for (i = 0; i < ARRAY_SIZE(gmux_data->irq_refs); i++)
+			if (gmux_data->irq_refs[i])
+				mask |= 1 << i;
+	}
+
+	if (mask == gmux_data->irq_mask)
+		return;
+	gmux_write8(gmux_data, GMUX_PORT_INTERRUPT_ENABLE, mask);
+	gmux_data->irq_mask = mask;
+	gmux_dbg("irq", "interrupt mask %#x\n", mask);
 }
 
-static int gmux_interrupt_get_status(void)
+static void gmux_irq_get(struct apple_gmux_data *gmux_data, int bits)
 {
-	return gmux_read8(GMUX_PORT_INTERRUPT_STATUS);
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&gmux_data->irq_lock, flags);
+	for (i = 0; i < ARRAY_SIZE(gmux_data->irq_refs); i++)
+		if (bits & (1 << i))
+			gmux_data->irq_refs[i]++;
+	gmux_irq_program(gmux_data);
+	spin_unlock_irqrestore(&gmux_data->irq_lock, flags);
 }
 
-static void gmux_interrupt_activate_status(void)
+static void gmux_irq_put(struct apple_gmux_data *gmux_data, int bits)
 {
-	int old_status;
-	int new_status;
-	
-	/* to reactivate interrupts write back current status */
-	old_status = gmux_read8(GMUX_PORT_INTERRUPT_STATUS);
-	gmux_write8(GMUX_PORT_INTERRUPT_STATUS, old_status);
-	new_status = gmux_read8(GMUX_PORT_INTERRUPT_STATUS);
-	
-	/* status = 0 indicates active interrupts */
-	if (new_status)
-		pr_info("gmux: error: activate_status, old_status %d new_status %d\n", old_status, new_status);
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&gmux_data->irq_lock, flags);
+	for (i = 0; i < ARRAY_SIZE(gmux_data->irq_refs); i++)
+		if ((bits & (1 << i)) && !WARN_ON(!gmux_data->irq_refs[i]))
+			gmux_data->irq_refs[i]--;
+	gmux_irq_program(gmux_data);
+	spin_unlock_irqrestore(&gmux_data->irq_lock, flags);
 }
 
-static void gmux_notify_handler(acpi_handle device, u32 value, void *context)
+/*
+ * Drop status @bits that are pending in the gmux or latched for the bottom
+ * half but not yet dispatched, so they can't be taken for a new event.
+ */
+static void gmux_irq_discard(struct apple_gmux_data *gmux_data, int bits)
 {
 	int status;
 
-	status = gmux_interrupt_get_status();
-	gmux_disable_interrupts();
-	pr_info("gmux: gpe handler called: status %d\n", status);
+	spin_lock_irq(&gmux_data->irq_lock);
+	status = gmux_read8(gmux_data, GMUX_PORT_INTERRUPT_STATUS);
+	if (status != GMUX_INTERRUPT_STATUS_ACTIVE && (status & bits))
+		gmux_write8(gmux_data, GMUX_PORT_INTERRUPT_STATUS,
+			    status & bits);
+	gmux_data->irq_status &= ~bits;
+	spin_unlock_irq(&gmux_data->irq_lock);
+}
 
-	gmux_interrupt_activate_status();
-	gmux_enable_interrupts();
-	
-	if (status & GMUX_INTERRUPT_STATUS_POWER)
-		complete(&powerchange_done);
+static void gmux_disable_interrupts(struct apple_gmux_data *gmux_data)
+{
+	spin_lock_irq(&gmux_data->irq_lock);
+	gmux_data->irq_enabled = false;
+	gmux_irq_program(gmux_data);
+	spin_unlock_irq(&gmux_data->irq_lock);
 }
 
-static const struct backlight_ops gmux_bl_ops = {
-	.get_brightness = gmux_get_brightness,
-	.update_status = gmux_update_status,
-};
+static void gmux_enable_interrupts(struct apple_gmux_data *gmux_data)
+{
+	spin_lock_irq(&gmux_data->irq_lock);
+	gmux_data->irq_enabled = true;
+	gmux_irq_program(gmux_data);
+	spin_unlock_irq(&gmux_data->irq_lock);
+}
 
-static int gmux_suspend(struct pnp_dev *dev, pm_message_t state)
+static bool gmux_power_settled(struct gmux_gpu *gpu)
 {
-	pr_info("gmux: suspend\n");
-	gmux_data.resume_client_id = gmux_read8(GMUX_PORT_SWITCH_DISPLAY) == 2 ?
-		VGA_SWITCHEROO_IGD : VGA_SWITCHEROO_DIS;
-	return 0;
+	enum gmux_power_state state = ACCESS_ONCE(gpu->power_state);
+
+	return state == GMUX_POWER_ON || state == GMUX_POWER_OFF;
 }
 
-static int gmux_resume(struct pnp_dev *dev)
+static int gmux_u32_cmp(const void *a, const void *b)
 {
-	pr_info("gmux: resume\n");
-	gmux_switchto(gmux_data.resume_client_id);
-	return 0;
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
 }
 
-static int __devinit gmux_probe(struct pnp_dev *pnp,
-				const struct pnp_device_id *id)
+/*
+ * Add a transition that took @us to @prof and update the percentiles and
+ * the timeout. Only transitions the gmux signalled are recorded, feeding
+ * timeouts back would make the timeout grow on every missed interrupt.
+ */
+static void gmux_power_profile_add(struct gmux_power_profile *prof, u32 us)
 {
-	struct resource *res;
-	struct backlight_properties props;
-	struct backlight_device *bdev;
-	u8 ver_major, ver_minor, ver_release;
-	acpi_status status;
-	int ret = -ENXIO;
+	u32 sorted[GMUX_POWER_SAMPLES];
+	unsigned int n;
+
+	prof->us[prof->count++ % GMUX_POWER_SAMPLES] = us;
+	n = min_t(unsigned int, prof->count, GMUX_POWER_SAMPLES);
+	memcpy(sorted, prof->us, n * sizeof(*sorted));
+	sort(sorted, n, sizeof(*sorted), gmux_u32_cmp, NULL);
+
+	prof->p50_us = sorted[n / 2];
+	prof->p99_us = sorted[min(n - 1, n * 99 / 100)];
+	prof->timeout_ms = min_t(unsigned int, GMUX_POWER_TIMEOUT_MAX_MS,
+				 DIV_ROUND_UP(prof->p99_us * 5 / 4, 1000) +
+				 GMUX_POWER_MARGIN_MS);
+}
 
-	res = pnp_get_resource(pnp, IORESOURCE_IO, 0);
-	if (!res) {
-		pr_err("Failed to find gmux I/O resource\n");
-		goto err_begin;
-	}
+/* Timeout for the transition @gpu is in, see GMUX_POWER_TIMEOUT_MS */
+static unsigned int gmux_power_timeout(struct gmux_gpu *gpu)
+{
+	struct gmux_power_profile *prof;
+	unsigned int timeout = GMUX_POWER_TIMEOUT_MS;
 
-	gmux_data.iostart = res->start;
-	gmux_data.iolen = res->end - res->start;
+	if (power_timeout_ms)
+		return power_timeout_ms;
 
-	if (gmux_data.iolen < GMUX_MIN_IO_LEN) {
-		pr_err("gmux I/O region too small (%lu < %u)\n",
-		       gmux_data.iolen, GMUX_MIN_IO_LEN);
-		goto err_begin;
-	}
+	spin_lock(&gpu->power_lock);
+	prof = &gpu->power_profile[gpu->power_state == GMUX_POWER_POWERING_UP];
+	if (prof->count >= GMUX_POWER_MIN_SAMPLES)
+		timeout = prof->timeout_ms;
+	spin_unlock(&gpu->power_lock);
 
-	if (!request_region(gmux_data.iostart, gmux_data.iolen,
-			    "Apple gmux")) {
-		pr_err("gmux I/O already in use\n");
-		goto err_begin;
-	}
+	return timeout;
+}
 
-	/*
-	 * On some machines the gmux is in ACPI even thought the machine
-	 * doesn't really have a gmux. Check for invalid version information
-	 * to detect this.
-	 */
-	ver_major = gmux_read8(GMUX_PORT_VERSION_MAJOR);
-	ver_minor = gmux_read8(GMUX_PORT_VERSION_MINOR);
-	ver_release = gmux_read8(GMUX_PORT_VERSION_RELEASE);
-	if (ver_major == 0xff && ver_minor == 0xff && ver_release == 0xff) {
-		pr_info("gmux device not present\n");
-		ret = -ENODEV;
-		goto err_release;
+/*
+ * Called when the gmux signals that a power transition has finished, or
+ * with @timed_out set when it didn't in time. Moves the state machine to
+ * the final state and wakes up everyone waiting.
+ *
+ * A transition that timed out keeps its power interrupt reference, so the
+ * late interrupt still arrives and goes into the profile and a slow
+ * machine gets a longer timeout. The next transition takes the reference
+ * over if it never comes.
+ */
+static void gmux_power_complete(struct gmux_gpu *gpu, bool timed_out)
+{
+	enum gmux_power_state old;
+	bool up = false, put = false;
+
+	spin_lock(&gpu->power_lock);
+	old = gpu->power_state;
+	if (old == GMUX_POWER_POWERING_UP)
+		gpu->power_state = GMUX_POWER_ON;
+	else if (old == GMUX_POWER_POWERING_DOWN)
+		gpu->power_state = GMUX_POWER_OFF;
+
+	if (old != gpu->power_state) {
+		gpu->power_timed_out = timed_out;
+		put = !timed_out;
+		up = old == GMUX_POWER_POWERING_UP;
+	} else if (gpu->power_timed_out && !timed_out) {
+		/* the late interrupt of a transition that timed out */
+		gpu->power_timed_out = false;
+		put = true;
+		up = old == GMUX_POWER_ON;
+	}
+	if (put)
+		gmux_power_profile_add(&gpu->power_profile[up],
+			clamp_t(s64, ktime_us_delta(ktime_get(),
+						    gpu->power_start),
+				0, GMUX_POWER_TIMEOUT_MAX_MS * USEC_PER_MSEC));
+	spin_unlock(&gpu->power_lock);
+
+	if (put)
+		gmux_irq_put(gpu->gmux_data, GMUX_INTERRUPT_STATUS_POWER);
+	if (old != gpu->power_state) {
+		sysfs_notify(&gpu->gmux_data->dev->kobj, NULL, "power_state");
+		gmux_uevent(gpu->gmux_data, "power",
+			    old == GMUX_POWER_POWERING_UP ?
+			    "GMUX_POWER=ON" : "GMUX_POWER=OFF");
+		trace_gmux_power_state(old, gpu->power_state);
+		gmux_dev_dbg(gpu->dev, "power", "powered %s\n",
+			     old == GMUX_POWER_POWERING_UP ? "up" : "down");
+		gmux_lat_record(gpu->gmux_data,
+				old == GMUX_POWER_POWERING_UP ?
+				GMUX_LAT_POWER_UP : GMUX_LAT_POWER_DOWN,
+				gpu->power_start);
 	}
 
-	pr_info("Found gmux version %d.%d.%d\n", ver_major, ver_minor,
-		ver_release);
+	wake_up_all(&gpu->power_waitq);
+}
 
-	memset(&props, 0, sizeof(props));
-	props.type = BACKLIGHT_PLATFORM;
-	props.max_brightness = gmux_read32(GMUX_PORT_MAX_BRIGHTNESS);
+/*
+ * Wait until a pending power transition has finished. If the gmux never
+ * signals completion the transition is assumed to be done anyway so the
+ * state machine can't get stuck.
+ */
+static int gmux_wait_for_power(struct gmux_gpu *gpu)
+{
+	unsigned int timeout = gmux_power_timeout(gpu);
+	long ret;
 
-	/*
-	 * Currently it's assumed that the maximum brightness is less than
-	 * 2^24 for compatibility with old gmux versions. Cap the max
-	 * brightness at this value, but print a warning if the hardware
-	 * reports something higher so that it can be fixed.
-	 */
-	if (WARN_ON(props.max_brightness > GMUX_MAX_BRIGHTNESS))
-		props.max_brightness = GMUX_MAX_BRIGHTNESS;
+	ret = wait_event_timeout(gpu->power_waitq, gmux_power_settled(gpu),
+				 msecs_to_jiffies(timeout));
+	if (ret)
+		return 0;
 
-	bdev = backlight_device_register("gmux_backlight", &pnp->dev,
-					 NULL, &gmux_bl_ops, &props);
-	if (IS_ERR(bdev)) {
-		ret = PTR_ERR(bdev);
-		goto err_release;
-	}
+	dev_warn(gpu->dev, "timeout waiting for power change (%u ms)\n",
+		 timeout);
+	atomic_inc(&gpu->gmux_data->stats.power_timeouts);
+	gmux_power_complete(gpu, true);
+	return -ETIMEDOUT;
+}
 
-	gmux_data.bdev = bdev;
-	bdev->props.brightness = gmux_get_brightness(bdev);
-	backlight_update_status(bdev);
+static enum vga_switcheroo_client_id gmux_client_from_mux(u8 val)
+{
+	return val == 2 ? VGA_SWITCHEROO_IGD : VGA_SWITCHEROO_DIS;
+}
 
-	gmux_data.dhandle = DEVICE_ACPI_HANDLE(&pnp->dev);
-	if (!gmux_data.dhandle) {
-		pr_err("Cannot find acpi device for pnp device %s\n", dev_name(&pnp->dev));
-		goto err_release;
-	} else {
-		struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
-		acpi_get_name(gmux_data.dhandle, ACPI_SINGLE_NAME, &buf);
-		pr_info("Found acpi handle for pnp device %s: %s\n", 
-			dev_name(&pnp->dev), (char *)buf.pointer);
-		kfree(buf.pointer);
-	}
+/*
+ * A mux write can make the panel retrain, so the muxes are only written
+ * when they don't already point at the requested GPU. The shadows hold
+ * what the hardware reported back after the last write and are re-read
+ * whenever the hardware may have changed behind our back.
+ */
+static const char *gmux_mux_name(u8 val)
+{
+	return val == 2 ? "IGD" : "DIS";
+}
 
-	status = acpi_install_notify_handler(gmux_data.dhandle, ACPI_DEVICE_NOTIFY, &gmux_notify_handler, pnp);
-	if (ACPI_FAILURE(status)) {
-		printk("Install notify handler failed: %s\n", acpi_format_exception(status));
-		goto err_notify;
-	}
+/*
+ * Tell userspace the display or external mux reads back something else
+ * than before, through a "mux" uevent and by waking up pollers of the
+ * mux attribute. Shadows that were never read don't count.
+ */
+static void gmux_mux_changed(struct apple_gmux_data *gmux_data,
+			     u8 old_display, u8 old_external)
+{
+	char display_env[24], external_env[24];
+	char *envp[] = { "GMUX_EVENT=mux", display_env, external_env, NULL };
+
+	lockdep_assert_held(&gmux_data->mux_lock);
+	if ((!old_display || old_display == gmux_data->display_shadow) &&
+	    (!old_external || old_external == gmux_data->external_shadow))
+		return;
+
+	snprintf(display_env, sizeof(display_env), "GMUX_DISPLAY=%s",
+		 gmux_mux_name(gmux_data->display_shadow));
+	snprintf(external_env, sizeof(external_env), "GMUX_EXTERNAL=%s",
+		 gmux_mux_name(gmux_data->external_shadow));
+	kobject_uevent_env(&gmux_data->dev->kobj, KOBJ_CHANGE, envp);
+	sysfs_notify(&gmux_data->dev->kobj, NULL, "mux");
+}
 
-	if (vga_switcheroo_register_handler(&gmux_handler))
-		goto err_register;
+static void gmux_mux_sync(struct apple_gmux_data *gmux_data)
+{
+	u8 old_display = gmux_data->display_shadow;
+	u8 old_external = gmux_data->external_shadow;
 
-	init_completion(&powerchange_done);
-	gmux_enable_interrupts();
+	lockdep_assert_held(&gmux_data->mux_lock);
 
-	return 0;
+	if (!gmux_data->mux_stale)
+		return;
 
-err_register:
-	status = acpi_remove_notify_handler(gmux_data.dhandle, ACPI_DEVICE_NOTIFY, &gmux_notify_handler);
-	if (ACPI_FAILURE(status)) {
-		printk("Install notify handler failed: %s\n", acpi_format_exception(status));
-	}
-err_notify:
-	backlight_device_unregister(bdev);
-err_release:
-	release_region(gmux_data.iostart, gmux_data.iolen);
-err_begin:
-	return ret;
+	gmux_data->display_shadow =
+		gmux_read8(gmux_data, GMUX_PORT_SWITCH_GET_DISPLAY);
+	gmux_data->ddc_shadow = gmux_read8(gmux_data, GMUX_PORT_SWITCH_DDC);
+	gmux_data->external_shadow =
+		gmux_read8(gmux_data, GMUX_PORT_SWITCH_GET_EXTERNAL);
+	gmux_data->mux_stale = false;
+	gmux_mux_changed(gmux_data, old_display, old_external);
 }
 
-static void __devexit gmux_remove(struct pnp_dev *pnp)
+static void gmux_mux_invalidate(struct apple_gmux_data *gmux_data)
 {
-	acpi_status status;
+	mutex_lock(&gmux_data->mux_lock);
+	gmux_data->mux_stale = true;
+	mutex_unlock(&gmux_data->mux_lock);
+}
 
-	vga_switcheroo_unregister_handler();
-	backlight_device_unregister(gmux_data.bdev);
-	gmux_disable_interrupts();
-	status = acpi_remove_notify_handler(gmux_data.dhandle, ACPI_DEVICE_NOTIFY, &gmux_notify_handler);
-	if (ACPI_FAILURE(status)) {
-		printk("Install notify handler failed: %s\n", acpi_format_exception(status));
+/* Write @val to @port unless @shadow already has it, then read back */
+static void gmux_mux_write(struct apple_gmux_data *gmux_data, int port,
+			   int get_port, u8 *shadow, u8 val)
+{
+	struct gmux_xfer_op xfer[] = {
+		GMUX_XFER_W8(port, val),
+		GMUX_XFER_EXPECT8(get_port, val),
+	};
+	u8 old;
+
+	lockdep_assert_held(&gmux_data->mux_lock);
+
+	gmux_mux_sync(gmux_data);
+	old = *shadow;
+	if (*shadow == val) {
+		atomic_inc(&gmux_data->stats.mux_writes_skipped);
+		return;
 	}
-	release_region(gmux_data.iostart, gmux_data.iolen);
+
+	if (gmux_xfer(gmux_data, "mux", xfer, ARRAY_SIZE(xfer)))
+		dev_warn(gmux_data->dev, "mux %#x reads back %#x instead of %#x\n",
+			 port, xfer[1].result, val);
+	*shadow = xfer[1].result;
+	if (shadow != &gmux_data->ddc_shadow)
+		gmux_mux_changed(gmux_data,
+				 shadow == &gmux_data->display_shadow ? old : 0,
+				 shadow == &gmux_data->external_shadow ? old : 0);
 }
 
-static const struct pnp_device_id gmux_device_ids[] = {
+static u8 gmux_mux_val(enum vga_switcheroo_client_id id)
+{
+	return id == VGA_SWITCHEROO_IGD ? 2 : 3;
+}
+
+static u8 gmux_ddc_val(enum vga_switcheroo_client_id id)
+{
+	return id == VGA_SWITCHEROO_IGD ? 1 : 2;
+}
+
+static void gmux_switch_display(struct apple_gmux_data *gmux_data,
+				enum vga_switcheroo_client_id id)
+{
+	gmux_mux_write(gmux_data, GMUX_PORT_SWITCH_DISPLAY,
+		       GMUX_PORT_SWITCH_GET_DISPLAY,
+		       &gmux_data->display_shadow, gmux_mux_val(id));
+}
+
+static void gmux_switch_external(struct apple_gmux_data *gmux_data,
+				 enum vga_switcheroo_client_id id)
+{
+	gmux_mux_write(gmux_data, GMUX_PORT_SWITCH_EXTERNAL,
+		       GMUX_PORT_SWITCH_GET_EXTERNAL,
+		       &gmux_data->external_shadow, gmux_mux_val(id));
+}
+
+static void gmux_write_ddc(struct apple_gmux_data *gmux_data,
+			   enum vga_switcheroo_client_id id)
+{
+	gmux_dbg("switch", "ddc to %s\n",
+		 id == VGA_SWITCHEROO_IGD ? "IGD" : "DIS");
+	gmux_mux_write(gmux_data, GMUX_PORT_SWITCH_DDC, GMUX_PORT_SWITCH_DDC,
+		       &gmux_data->ddc_shadow, gmux_ddc_val(id));
+}
+
+/* Whether all muxes already point at @id */
+static bool gmux_mux_is(struct apple_gmux_data *gmux_data,
+			enum vga_switcheroo_client_id id)
+{
+	gmux_mux_sync(gmux_data);
+	return gmux_data->display_shadow == gmux_mux_val(id) &&
+	       gmux_data->ddc_shadow == gmux_ddc_val(id) &&
+	       gmux_data->external_shadow == gmux_mux_val(id);
+}
+
+static int gmux_switchddc(enum vga_switcheroo_client_id id)
+{
+	struct apple_gmux_data *gmux_data = apple_gmux_data;
+
+	mutex_lock(&gmux_data->mux_lock);
+	/* DDC has been moved away from a prepared switch target */
+	if (gmux_data->prepared && gmux_data->prepared_id != id)
+		gmux_data->prepared = false;
+
+	gmux_write_ddc(gmux_data, id);
+	mutex_unlock(&gmux_data->mux_lock);
+	return 0;
+}
+
+/*
+ * Look up the PWRD method of a discrete GPU once, it is evaluated on
+ * every power transition. Only the GPU behind the gmux has one.
+ */
+static void gmux_setup_pwrd(struct gmux_gpu *gpu)
+{
+	acpi_handle gfx_handle;
+	acpi_handle pwrd_handle = NULL;
+	acpi_object_type type;
+	acpi_status status;
+
+	gpu->pwrd_probed = true;
+
+	/*gfx_handle = acpi_get_child(DEVICE_ACPI_HANDLE(&pdev->dev), 0);*/
+	gfx_handle = DEVICE_ACPI_HANDLE(gpu->dev);
+	gmux_dev_dbg(gpu->dev, "power", "gfx_handle: %p\n", gfx_handle);
+	status = acpi_get_handle(gfx_handle, "PWRD", &pwrd_handle);
+	if (ACPI_FAILURE(status)) {
+		/* expected for GPUs not behind the gmux, like external ones */
+		gmux_dev_dbg(gpu->dev, "power", "no PWRD method: %s\n",
+			     acpi_format_exception(status));
+		return;
+	}
+
+	status = acpi_get_type(pwrd_handle, &type);
+	if (ACPI_FAILURE(status) || type != ACPI_TYPE_METHOD) {
+		pr_err("PWRD is not a method\n");
+		return;
+	}
+
+	gpu->pwrd_arg.type = ACPI_TYPE_INTEGER;
+	gpu->pwrd_args.count = 1;
+	gpu->pwrd_args.pointer = &gpu->pwrd_arg;
+	gpu->pwrd_handle = pwrd_handle;
+}
+
+static int gmux_call_acpi_pwrd(struct gmux_gpu *gpu, int arg)
+{
+	acpi_status status;
+
+	if (!gpu->pwrd_handle)
+		return -ENODEV;
+
+	gpu->pwrd_arg.integer.value = arg;
+
+	/* PWRD doesn't return anything useful, let ACPICA drop the result */
+	status = acpi_evaluate_object(gpu->pwrd_handle, NULL,
+				      &gpu->pwrd_args, NULL);
+	trace_gmux_pwrd(arg, ACPI_FAILURE(status) ? -ENODEV : 0);
+	if (ACPI_FAILURE(status)) {
+		pr_err("PWRD call failed: %s\n", acpi_format_exception(status));
+		atomic_inc(&gpu->gmux_data->stats.pwrd_failures);
+		return -ENODEV;
+	}
+
+	gmux_dev_dbg(gpu->dev, "power", "PWRD(%d) done\n", arg);
+	return 0;
+}
+
+/*
+ * Power a discrete GPU up or down. With @wait set this only returns once
+ * the gmux has confirmed the transition, otherwise the transition is only
+ * started and gmux_wait_for_power() can be used to wait for it later.
+ *
+ * Only power_mutex is held while waiting, so brightness changes and the
+ * other GPUs aren't held up by a transition.
+ *
+ * Each GPU has its own state machine, but GMUX_PORT_DISCRETE_POWER only
+ * controls the GPU behind the gmux. Other discrete GPUs, like external
+ * ones, are left to their own drivers.
+ */
+static int gmux_set_discrete_state(struct gmux_gpu *gpu,
+				   enum vga_switcheroo_state state, bool wait)
+{
+	struct apple_gmux_data *gmux_data = gpu->gmux_data;
+	struct gmux_xfer_op power_up[] = {
+		GMUX_XFER_W8(GMUX_PORT_DISCRETE_POWER, 1),
+		GMUX_XFER_W8(GMUX_PORT_DISCRETE_POWER, 3),
+	};
+	struct gmux_xfer_op power_down[] = {
+		GMUX_XFER_W8(GMUX_PORT_DISCRETE_POWER, 1),
+		GMUX_XFER_W8(GMUX_PORT_DISCRETE_POWER, 0),
+	};
+	enum gmux_power_state target;
+	bool held;
+	int ret = 0;
+
+	if (gpu != gmux_data->discrete)
+		return -ENODEV;
+
+	target = state == VGA_SWITCHEROO_ON ? GMUX_POWER_ON : GMUX_POWER_OFF;
+
+	mutex_lock(&gpu->power_mutex);
+	/* let a transition that is already in flight finish first */
+	if (!gmux_power_settled(gpu))
+		gmux_wait_for_power(gpu);
+
+	spin_lock(&gpu->power_lock);
+	if (gpu->power_state == target) {
+		spin_unlock(&gpu->power_lock);
+		mutex_unlock(&gpu->power_mutex);
+		return 0;
+	}
+	spin_unlock(&gpu->power_lock);
+
+	/*
+	 * A power interrupt still pending now is the late one of a transition
+	 * that timed out and would complete this one early. One the bottom
+	 * half already picked up predates power_start and is ignored there.
+	 */
+	gmux_irq_discard(gmux_data, GMUX_INTERRUPT_STATUS_POWER);
+
+	spin_lock(&gpu->power_lock);
+	trace_gmux_power_state(gpu->power_state, target == GMUX_POWER_ON ?
+			       GMUX_POWER_POWERING_UP :
+			       GMUX_POWER_POWERING_DOWN);
+	gpu->power_state = target == GMUX_POWER_ON ?
+		GMUX_POWER_POWERING_UP : GMUX_POWER_POWERING_DOWN;
+	gpu->power_start = ktime_get();
+	gpu->power_changed = jiffies;
+	held = gpu->power_timed_out;
+	gpu->power_timed_out = false;
+	spin_unlock(&gpu->power_lock);
+
+	/* dropped again by gmux_power_complete() */
+	if (!held)
+		gmux_irq_get(gmux_data, GMUX_INTERRUPT_STATUS_POWER);
+	sysfs_notify(&gmux_data->dev->kobj, NULL, "power_state");
+	gmux_dev_dbg(gpu->dev, "power", "powering %s\n",
+		     state == VGA_SWITCHEROO_ON ? "up" : "down");
+	if (state == VGA_SWITCHEROO_ON) {
+		gmux_call_acpi_pwrd(gpu, 0);
+		gmux_xfer(gmux_data, "power_up", power_up,
+			  ARRAY_SIZE(power_up));
+	} else {
+		gmux_xfer(gmux_data, "power_down", power_down,
+			  ARRAY_SIZE(power_down));
+		gmux_call_acpi_pwrd(gpu, 1);
+	}
+
+	if (wait)
+		ret = gmux_wait_for_power(gpu);
+	mutex_unlock(&gpu->power_mutex);
+
+	return ret;
+}
+
+/*
+ * Power requests from switcheroo, runtime PM and the policy come in
+ * bursts, and each cycle costs the PWRD call and a full power sequence.
+ * A power down within power_min_on_ms of the last power up is deferred
+ * to the end of that window, and is dropped if a power up arrives in the
+ * meantime. A power up within power_min_off_ms of the last power down
+ * waits for the window to pass.
+ */
+static int gmux_request_discrete_state(struct gmux_gpu *gpu,
+				       enum vga_switcheroo_state state,
+				       bool wait)
+{
+	struct gmux_stats *stats = &gpu->gmux_data->stats;
+	enum gmux_power_state cur = ACCESS_ONCE(gpu->power_state);
+	unsigned long until, now = jiffies;
+
+	if (state == VGA_SWITCHEROO_ON) {
+		if (cancel_delayed_work(&gpu->power_down_work)) {
+			atomic_inc(&stats->power_cycles_avoided);
+			gmux_dev_dbg(gpu->dev, "power",
+				     "deferred power down dropped\n");
+		}
+
+		until = gpu->power_changed + msecs_to_jiffies(power_min_off_ms);
+		if (cur == GMUX_POWER_OFF && time_before(now, until))
+			msleep(jiffies_to_msecs(until - now));
+	} else {
+		until = gpu->power_changed + msecs_to_jiffies(power_min_on_ms);
+		if ((cur == GMUX_POWER_ON || cur == GMUX_POWER_POWERING_UP) &&
+		    time_before(now, until)) {
+			if (schedule_delayed_work(&gpu->power_down_work,
+						  until - now))
+				atomic_inc(&stats->power_downs_deferred);
+			return 0;
+		}
+	}
+
+	return gmux_set_discrete_state(gpu, state, wait);
+}
+
+static void gmux_power_down_work_func(struct work_struct *work)
+{
+	struct gmux_gpu *gpu =
+		container_of(work, struct gmux_gpu, power_down_work.work);
+
+	gmux_set_discrete_state(gpu, VGA_SWITCHEROO_OFF, true);
+}
+
+/*
+ * Switches and power changes are queued as stages on an ordered
+ * workqueue, so the steps of a switch happen strictly in the order they
+ * were requested. Internal callers return right away. The vga_switcheroo
+ * callbacks wait for the stage switcheroo depends on, see
+ * gmux_wait_for_stage(), and userspace gets the non-blocking part through
+ * the prepare attribute. Userspace can poll the switch_state sysfs
+ * attribute to learn when the pipeline has drained.
+ */
+enum gmux_stage {
+	GMUX_STAGE_POWER,
+	GMUX_STAGE_PREWARM,
+	GMUX_STAGE_DDC,
+	GMUX_STAGE_DISPLAY,
+	GMUX_STAGE_EXTERNAL,
+};
+
+struct gmux_stage_work {
+	struct work_struct work;
+	struct apple_gmux_data *gmux_data;
+	enum gmux_stage stage;
+	enum vga_switcheroo_client_id id;
+	enum vga_switcheroo_state state;
+	ktime_t queued;
+	int seq;
+};
+
+static void gmux_run_stage(struct apple_gmux_data *gmux_data,
+			   enum gmux_stage stage,
+			   enum vga_switcheroo_client_id id,
+			   enum vga_switcheroo_state state, ktime_t queued)
+{
+	struct gmux_gpu *gpu = gmux_data->discrete;
+	u8 display;
+	s64 us;
+
+	switch (stage) {
+	case GMUX_STAGE_POWER:
+		if (gpu)
+			gmux_request_discrete_state(gpu, state, true);
+		break;
+	case GMUX_STAGE_PREWARM:
+		if (gpu)
+			gmux_request_discrete_state(gpu, VGA_SWITCHEROO_ON,
+						    false);
+		break;
+	case GMUX_STAGE_DDC:
+		mutex_lock(&gmux_data->mux_lock);
+		gmux_write_ddc(gmux_data, id);
+		mutex_unlock(&gmux_data->mux_lock);
+		break;
+	case GMUX_STAGE_DISPLAY:
+		/*
+		 * A pre-warmed discrete GPU might still be training, don't
+		 * hand it the panel before it has finished powering up.
+		 */
+		if (id == VGA_SWITCHEROO_DIS && gpu && !gmux_power_settled(gpu))
+			gmux_wait_for_power(gpu);
+		mutex_lock(&gmux_data->mux_lock);
+		gmux_switch_display(gmux_data, id);
+		display = gmux_data->display_shadow;
+		mutex_unlock(&gmux_data->mux_lock);
+		/* the panel has moved, this is what the user waits for */
+		us = gmux_lat_record(gmux_data, GMUX_LAT_SWITCH, queued);
+		gmux_dbg("switch", "display to %s after %lld us\n",
+			 id == VGA_SWITCHEROO_IGD ? "IGD" : "DIS", us);
+		trace_gmux_switch_end(id, display, us);
+		break;
+	case GMUX_STAGE_EXTERNAL:
+		mutex_lock(&gmux_data->mux_lock);
+		gmux_switch_external(gmux_data, id);
+		mutex_unlock(&gmux_data->mux_lock);
+		break;
+	}
+}
+
+static bool gmux_switch_idle(struct apple_gmux_data *gmux_data)
+{
+	return atomic_read(&gmux_data->stages_pending) == 0;
+}
+
+static bool gmux_stage_finished(struct apple_gmux_data *gmux_data, int seq)
+{
+	return atomic_read(&gmux_data->stage_done_seq) - seq >= 0;
+}
+
+static void gmux_stage_done(struct apple_gmux_data *gmux_data, int seq)
+{
+	int done = atomic_read(&gmux_data->stage_done_seq);
+	bool idle;
+
+	/* a stage run synchronously may finish out of order */
+	while (seq - done > 0) {
+		int old = atomic_cmpxchg(&gmux_data->stage_done_seq, done, seq);
+
+		if (old == done)
+			break;
+		done = old;
+	}
+
+	idle = atomic_dec_and_test(&gmux_data->stages_pending);
+	wake_up_all(&gmux_data->switch_waitq);
+	if (!idle)
+		return;
+
+	gmux_irq_put(gmux_data, GMUX_INTERRUPT_STATUS_DISPLAY);
+	sysfs_notify(&gmux_data->dev->kobj, NULL, "switch_state");
+}
+
+static void gmux_stage_work_func(struct work_struct *work)
+{
+	struct gmux_stage_work *sw =
+		container_of(work, struct gmux_stage_work, work);
+	struct apple_gmux_data *gmux_data = sw->gmux_data;
+
+	int seq = sw->seq;
+
+	gmux_run_stage(gmux_data, sw->stage, sw->id, sw->state, sw->queued);
+	kfree(sw);
+	gmux_stage_done(gmux_data, seq);
+}
+
+/* Returns a sequence number to pass to gmux_wait_for_stage() */
+static int gmux_queue_stage(struct apple_gmux_data *gmux_data,
+			    enum gmux_stage stage,
+			    enum vga_switcheroo_client_id id,
+			    enum vga_switcheroo_state state)
+{
+	struct gmux_stage_work *sw;
+	int seq;
+
+	if (atomic_inc_return(&gmux_data->stages_pending) == 1) {
+		gmux_irq_get(gmux_data, GMUX_INTERRUPT_STATUS_DISPLAY);
+		sysfs_notify(&gmux_data->dev->kobj, NULL, "switch_state");
+	}
+
+	sw = kzalloc(sizeof(*sw), GFP_KERNEL);
+	if (!sw) {
+		spin_lock(&gmux_data->stage_lock);
+		seq = atomic_inc_return(&gmux_data->stage_seq);
+		spin_unlock(&gmux_data->stage_lock);
+
+		/*
+		 * Nothing else can be done here. Drain the pipeline so
+		 * ordering is kept and do the stage synchronously.
+		 */
+		flush_workqueue(gmux_data->wq);
+		gmux_run_stage(gmux_data, stage, id, state, ktime_get());
+		gmux_stage_done(gmux_data, seq);
+		return seq;
+	}
+
+	INIT_WORK(&sw->work, gmux_stage_work_func);
+	sw->gmux_data = gmux_data;
+	sw->stage = stage;
+	sw->id = id;
+	sw->state = state;
+	sw->queued = ktime_get();
+
+	/* the ordered wq must run stages in sequence number order */
+	spin_lock(&gmux_data->stage_lock);
+	seq = atomic_inc_return(&gmux_data->stage_seq);
+	sw->seq = seq;
+	queue_work(gmux_data->wq, &sw->work);
+	spin_unlock(&gmux_data->stage_lock);
+	return seq;
+}
+
+/* Block until the stage with sequence number @seq has been carried out */
+static void gmux_wait_for_stage(struct apple_gmux_data *gmux_data, int seq)
+{
+	wait_event(gmux_data->switch_waitq,
+		   gmux_stage_finished(gmux_data, seq));
+}
+
+/* Block until all queued stages have been carried out */
+static void gmux_wait_for_switch(struct apple_gmux_data *gmux_data)
+{
+	wait_event(gmux_data->switch_waitq, gmux_switch_idle(gmux_data));
+}
+
+/*
+ * Get ready for a switch to @id without touching the display muxes yet.
+ * The discrete GPU is powered up without waiting for it and DDC is routed
+ * to the new GPU right away, so the EDID probe overlaps with the GPU
+ * finishing its power up. gmux_switchto() then only has to flip the muxes.
+ */
+static void gmux_prepare(struct apple_gmux_data *gmux_data,
+			 enum vga_switcheroo_client_id id)
+{
+	if (id == VGA_SWITCHEROO_DIS)
+		gmux_queue_stage(gmux_data, GMUX_STAGE_PREWARM, id,
+				 VGA_SWITCHEROO_ON);
+	gmux_queue_stage(gmux_data, GMUX_STAGE_DDC, id, VGA_SWITCHEROO_ON);
+
+	mutex_lock(&gmux_data->mux_lock);
+	gmux_data->prepared_id = id;
+	gmux_data->prepared = true;
+	mutex_unlock(&gmux_data->mux_lock);
+}
+
+/*
+ * Queue the stages of a switch to @id. Returns the sequence number of the
+ * display stage, or 0 if the muxes already point at @id.
+ */
+static int gmux_queue_switch(struct apple_gmux_data *gmux_data,
+			     enum vga_switcheroo_client_id id)
+{
+	bool prepared, noop;
+	int seq;
+
+	/* stages take mux_lock themselves, don't queue them while holding it */
+	mutex_lock(&gmux_data->mux_lock);
+	prepared = gmux_data->prepared && gmux_data->prepared_id == id;
+	gmux_data->prepared = false;
+	/* queued stages may still move the muxes, only trust an idle pipe */
+	noop = gmux_switch_idle(gmux_data) && gmux_mux_is(gmux_data, id);
+	mutex_unlock(&gmux_data->mux_lock);
+
+	if (noop) {
+		gmux_dbg("switch", "already on %s\n",
+			 id == VGA_SWITCHEROO_IGD ? "IGD" : "DIS");
+		return 0;
+	}
+
+	trace_gmux_switch_begin(id, prepared);
+	gmux_dbg("switch", "to %s%s\n", id == VGA_SWITCHEROO_IGD ? "IGD" : "DIS",
+		 prepared ? " (prepared)" : "");
+	if (!prepared)
+		gmux_queue_stage(gmux_data, GMUX_STAGE_DDC, id,
+				 VGA_SWITCHEROO_ON);
+
+	seq = gmux_queue_stage(gmux_data, GMUX_STAGE_DISPLAY, id,
+			       VGA_SWITCHEROO_ON);
+	gmux_queue_stage(gmux_data, GMUX_STAGE_EXTERNAL, id, VGA_SWITCHEROO_ON);
+	return seq;
+}
+
+/*
+ * vga_switcheroo reprobes the connectors as soon as this returns, so wait
+ * for the panel to have moved.
+ */
+static int gmux_switchto(enum vga_switcheroo_client_id id)
+{
+	int seq = gmux_queue_switch(apple_gmux_data, id);
+
+	if (seq)
+		gmux_wait_for_stage(apple_gmux_data, seq);
+	return 0;
+}
+
+/*
+ * Driver-assisted switch policy. Moving the panel has to go through
+ * vga_switcheroo so the DRM drivers can hand over, so the policy only
+ * powers the discrete GPU itself and recommends a GPU to userspace with a
+ * "policy" uevent carrying GMUX_RECOMMEND=IGD or DIS:
+ *
+ *  - On AC, or while the discrete GPU is in use, that is runtime resumed
+ *    by its driver because e.g. a client opened its DRM node, DIS is
+ *    recommended and the GPU is pre-warmed.
+ *  - On battery, once the GPU has been idle for policy_idle_ms, IGD is
+ *    recommended and the GPU is powered down if nothing is routed to it
+ *    and runtime PM has suspended it.
+ *
+ * A recommendation doesn't flip again within policy_hysteresis_ms. The
+ * discrete GPU starts out idle, so it is powered down if it's not needed.
+ */
+static void gmux_policy_apply(struct apple_gmux_data *gmux_data,
+			      enum vga_switcheroo_client_id want)
+{
+	struct gmux_gpu *gpu = gmux_data->discrete;
+	bool routed;
+
+	gmux_dbg("switch", "policy recommends %s\n",
+		 want == VGA_SWITCHEROO_IGD ? "IGD" : "DIS");
+	gmux_uevent(gmux_data, "policy", want == VGA_SWITCHEROO_IGD ?
+		    "GMUX_RECOMMEND=IGD" : "GMUX_RECOMMEND=DIS");
+
+	if (!gpu)
+		return;
+
+	if (want == VGA_SWITCHEROO_DIS) {
+		gmux_queue_stage(gmux_data, GMUX_STAGE_PREWARM, want,
+				 VGA_SWITCHEROO_ON);
+		return;
+	}
+
+	mutex_lock(&gmux_data->mux_lock);
+	gmux_mux_sync(gmux_data);
+	routed = gmux_data->display_shadow == gmux_mux_val(VGA_SWITCHEROO_DIS) ||
+		 gmux_data->external_shadow == gmux_mux_val(VGA_SWITCHEROO_DIS);
+	mutex_unlock(&gmux_data->mux_lock);
+
+	/*
+	 * Only cut the power once runtime PM says the driver let go of the
+	 * GPU. Without runtime PM a driver may be using it behind our back,
+	 * so only the recommendation goes out. The emulated GPU has no
+	 * driver.
+	 */
+	if (!routed && (gpu->runtime_pm ? pm_runtime_suspended(gpu->dev) :
+					  !gpu->pdev))
+		gmux_queue_stage(gmux_data, GMUX_STAGE_POWER,
+				 VGA_SWITCHEROO_DIS, VGA_SWITCHEROO_OFF);
+}
+
+static void gmux_policy_work_func(struct work_struct *work)
+{
+	struct apple_gmux_data *gmux_data =
+		container_of(work, struct apple_gmux_data, policy_work.work);
+	enum vga_switcheroo_client_id want;
+	unsigned long next, now = jiffies;
+
+	mutex_lock(&gmux_data->policy_lock);
+	if (power_supply_is_system_supplied() > 0 || gmux_data->policy_busy) {
+		want = VGA_SWITCHEROO_DIS;
+	} else {
+		next = gmux_data->policy_idle_since +
+		       msecs_to_jiffies(policy_idle_ms);
+		if (time_before(now, next)) {
+			schedule_delayed_work(&gmux_data->policy_work,
+					      next - now);
+			goto out;
+		}
+		want = VGA_SWITCHEROO_IGD;
+	}
+
+	if (gmux_data->policy_valid) {
+		if (want == gmux_data->policy_want)
+			goto out;
+
+		next = gmux_data->policy_changed +
+		       msecs_to_jiffies(policy_hysteresis_ms);
+		if (time_before(now, next)) {
+			schedule_delayed_work(&gmux_data->policy_work,
+					      next - now);
+			goto out;
+		}
+	}
+
+	gmux_data->policy_valid = true;
+	gmux_data->policy_want = want;
+	gmux_data->policy_changed = now;
+	mutex_unlock(&gmux_data->policy_lock);
+
+	gmux_policy_apply(gmux_data, want);
+	return;
+
+out:
+	mutex_unlock(&gmux_data->policy_lock);
+}
+
+static void gmux_policy_kick(struct apple_gmux_data *gmux_data,
+			     unsigned long delay)
+{
+	cancel_delayed_work(&gmux_data->policy_work);
+	schedule_delayed_work(&gmux_data->policy_work, delay);
+}
+
+/* Called from runtime PM when the discrete GPU is resumed or suspended */
+static void gmux_policy_set_busy(struct apple_gmux_data *gmux_data,
+				 bool busy)
+{
+	bool running;
+
+	mutex_lock(&gmux_data->policy_lock);
+	gmux_data->policy_busy = busy;
+	if (!busy)
+		gmux_data->policy_idle_since = jiffies;
+	running = gmux_data->policy_running;
+	mutex_unlock(&gmux_data->policy_lock);
+
+	if (running)
+		gmux_policy_kick(gmux_data, 0);
+}
+
+static int gmux_policy_acpi_notify(struct notifier_block *nb,
+				   unsigned long val, void *data)
+{
+	struct apple_gmux_data *gmux_data =
+		container_of(nb, struct apple_gmux_data, policy_nb);
+	struct acpi_bus_event *event = data;
+
+	if (strcmp(event->device_class, "ac_adapter"))
+		return NOTIFY_DONE;
+
+	/* give the AC driver a moment to update the power supply state */
+	gmux_policy_kick(gmux_data, msecs_to_jiffies(100));
+	return NOTIFY_OK;
+}
+
+static void gmux_policy_start(struct apple_gmux_data *gmux_data)
+{
+	if (!policy)
+		return;
+
+	mutex_lock(&gmux_data->policy_lock);
+	gmux_data->policy_idle_since = jiffies;
+	gmux_data->policy_running = true;
+	mutex_unlock(&gmux_data->policy_lock);
+
+	gmux_data->policy_nb.notifier_call = gmux_policy_acpi_notify;
+	register_acpi_notifier(&gmux_data->policy_nb);
+	gmux_policy_kick(gmux_data, 0);
+}
+
+static void gmux_policy_stop(struct apple_gmux_data *gmux_data)
+{
+	if (!policy)
+		return;
+
+	unregister_acpi_notifier(&gmux_data->policy_nb);
+	mutex_lock(&gmux_data->policy_lock);
+	gmux_data->policy_running = false;
+	mutex_unlock(&gmux_data->policy_lock);
+	cancel_delayed_work_sync(&gmux_data->policy_work);
+}
+
+static int gmux_set_power_state(enum vga_switcheroo_client_id id,
+				enum vga_switcheroo_state state)
+{
+	int seq;
+
+	if (id == VGA_SWITCHEROO_IGD)
+		return 0;
+
+	/*
+	 * vga_switcheroo resumes the GPU driver right after a power up
+	 * returns, so that has to wait. A power down can finish behind it.
+	 */
+	seq = gmux_queue_stage(apple_gmux_data, GMUX_STAGE_POWER, id, state);
+	if (state == VGA_SWITCHEROO_ON)
+		gmux_wait_for_stage(apple_gmux_data, seq);
+	return 0;
+}
+
+/*
+ * Runtime PM for the discrete GPU. The GPU driver only knows how to put
+ * the device into a low power PCI state, cutting the power completely is
+ * up to the gmux. So the discrete device is put into a PM domain which
+ * wraps the PCI bus runtime PM callbacks with the PWRD and
+ * GMUX_PORT_DISCRETE_POWER sequence, all other callbacks go straight to
+ * the PCI bus.
+ */
+static struct gmux_gpu *gmux_dev_to_gpu(struct device *dev)
+{
+	return container_of(dev->pm_domain, struct gmux_gpu, pm_domain);
+}
+
+static int gmux_dgpu_runtime_suspend(struct device *dev)
+{
+	struct gmux_gpu *gpu = gmux_dev_to_gpu(dev);
+	int ret;
+
+	if (dev->bus->pm->runtime_suspend) {
+		ret = dev->bus->pm->runtime_suspend(dev);
+		if (ret)
+			return ret;
+	}
+
+	gmux_request_discrete_state(gpu, VGA_SWITCHEROO_OFF, true);
+	gmux_policy_set_busy(gpu->gmux_data, false);
+	return 0;
+}
+
+static int gmux_dgpu_runtime_resume(struct device *dev)
+{
+	struct gmux_gpu *gpu = gmux_dev_to_gpu(dev);
+
+	gmux_policy_set_busy(gpu->gmux_data, true);
+	gmux_request_discrete_state(gpu, VGA_SWITCHEROO_ON, true);
+
+	if (dev->bus->pm->runtime_resume)
+		return dev->bus->pm->runtime_resume(dev);
+
+	return 0;
+}
+
+static int gmux_dgpu_runtime_idle(struct device *dev)
+{
+	int ret;
+
+	if (dev->bus->pm->runtime_idle) {
+		ret = dev->bus->pm->runtime_idle(dev);
+		if (ret)
+			return ret;
+	}
+
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_autosuspend(dev);
+	return -EBUSY;
+}
+
+static void gmux_setup_runtime_pm(struct gmux_gpu *gpu)
+{
+	struct device *dev = gpu->dev;
+
+	if (dgpu_autosuspend_delay < 0 || !dev->bus->pm || dev->pm_domain)
+		return;
+
+	gpu->pm_domain.ops = *dev->bus->pm;
+	gpu->pm_domain.ops.runtime_suspend = gmux_dgpu_runtime_suspend;
+	gpu->pm_domain.ops.runtime_resume = gmux_dgpu_runtime_resume;
+	gpu->pm_domain.ops.runtime_idle = gmux_dgpu_runtime_idle;
+	dev->pm_domain = &gpu->pm_domain;
+
+	pm_runtime_set_autosuspend_delay(dev, dgpu_autosuspend_delay);
+	pm_runtime_use_autosuspend(dev);
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_allow(dev);
+	gpu->runtime_pm = true;
+}
+
+static void gmux_teardown_runtime_pm(struct gmux_gpu *gpu)
+{
+	struct device *dev = gpu->dev;
+
+	if (!gpu->runtime_pm)
+		return;
+
+	/* power the GPU back up, nobody else would do it once we're gone */
+	pm_runtime_get_sync(dev);
+	pm_runtime_forbid(dev);
+	pm_runtime_dont_use_autosuspend(dev);
+	dev->pm_domain = NULL;
+	pm_runtime_put_noidle(dev);
+	gpu->runtime_pm = false;
+}
+
+static int gmux_init(void)
+{
+	return 0;
+}
+
+static struct gmux_gpu *gmux_find_gpu(struct apple_gmux_data *gmux_data,
+				      struct pci_dev *pdev)
+{
+	struct gmux_gpu *gpu;
+
+	list_for_each_entry(gpu, &gmux_data->gpus, list)
+		if (gpu->pdev == pdev)
+			return gpu;
+
+	return NULL;
+}
+
+/*
+ * There can be more than one discrete GPU, e.g. a Thunderbolt GPU next to
+ * the one behind the gmux. Each gets its own state, but only the one with
+ * a PWRD method is powered and switched through the gmux. If no GPU has
+ * one the first discrete GPU is assumed to be behind the gmux.
+ */
+static void gmux_claim_gpu(struct apple_gmux_data *gmux_data,
+			   struct gmux_gpu *gpu)
+{
+	struct gmux_gpu *cur = gmux_data->discrete;
+
+	if (!gpu->pwrd_probed)
+		gmux_setup_pwrd(gpu);
+
+	if (cur == gpu || (cur && (cur->pwrd_handle || !gpu->pwrd_handle)))
+		return;
+
+	gmux_data->discrete = gpu;
+	dev_info(gpu->dev, "discrete GPU behind the gmux\n");
+	if (gpu->pwrd_handle)
+		gmux_setup_runtime_pm(gpu);
+}
+
+static struct gmux_gpu *gmux_add_gpu(struct apple_gmux_data *gmux_data,
+				     struct pci_dev *pdev)
+{
+	struct gmux_gpu *gpu;
+
+	gpu = kzalloc(sizeof(*gpu), GFP_KERNEL);
+	if (!gpu)
+		return NULL;
+
+	gpu->gmux_data = gmux_data;
+	gpu->pdev = pci_dev_get(pdev);
+	gpu->dev = pdev ? &pdev->dev : gmux_data->dev;
+	/*
+	 * The discrete GPU is powered on at boot, but after a module reload
+	 * it may have been left off, so go by what the gmux reports.
+	 */
+	mutex_init(&gpu->power_mutex);
+	spin_lock_init(&gpu->power_lock);
+	gpu->power_state = gmux_read8(gmux_data, GMUX_PORT_DISCRETE_POWER) ?
+			   GMUX_POWER_ON : GMUX_POWER_OFF;
+	gpu->power_irq_us = -1;
+	gpu->power_changed = jiffies;
+	INIT_DELAYED_WORK(&gpu->power_down_work, gmux_power_down_work_func);
+	init_waitqueue_head(&gpu->power_waitq);
+
+	list_add_tail(&gpu->list, &gmux_data->gpus);
+	return gpu;
+}
+
+static void gmux_free_gpus(struct apple_gmux_data *gmux_data)
+{
+	struct gmux_gpu *gpu, *tmp;
+
+	if (gmux_data->discrete)
+		gmux_teardown_runtime_pm(gmux_data->discrete);
+	gmux_data->discrete = NULL;
+
+	list_for_each_entry_safe(gpu, tmp, &gmux_data->gpus, list) {
+		cancel_delayed_work_sync(&gpu->power_down_work);
+		list_del(&gpu->list);
+		pci_dev_put(gpu->pdev);
+		kfree(gpu);
+	}
+}
+
+static int gmux_get_client_id(struct pci_dev *pdev)
+{
+	struct apple_gmux_data *gmux_data = apple_gmux_data;
+	struct gmux_gpu *gpu;
+
+	gmux_dev_dbg(&pdev->dev, "switch", "get client id rom shadow: %x %d\n",
+		     pdev->vendor,
+		     pdev->resource[PCI_ROM_RESOURCE].flags & IORESOURCE_ROM_SHADOW);
+	if (pdev->vendor == PCI_VENDOR_ID_INTEL) {
+		pdev->resource[PCI_ROM_RESOURCE].flags &= ~IORESOURCE_ROM_SHADOW;
+		gmux_dev_dbg(&pdev->dev, "switch", "not boot video device\n");
+	} else {
+		pdev->resource[PCI_ROM_RESOURCE].flags |= IORESOURCE_ROM_SHADOW;
+		gmux_dev_dbg(&pdev->dev, "switch", "boot video device\n");
+	}
+
+	/* early mbps with switchable graphics use nvidia integrated graphics,
+	 * hardcode that the 9400M is integrated */
+	if (pdev->vendor == PCI_VENDOR_ID_INTEL) {
+		return VGA_SWITCHEROO_IGD;
+	} else if (pdev->vendor == PCI_VENDOR_ID_NVIDIA && pdev->device == 0x0863) {
+		return VGA_SWITCHEROO_IGD;
+	} else {
+		gpu = gmux_find_gpu(gmux_data, pdev);
+		if (!gpu)
+			gpu = gmux_add_gpu(gmux_data, pdev);
+		if (gpu)
+			gmux_claim_gpu(gmux_data, gpu);
+		return VGA_SWITCHEROO_DIS;
+	}
+}
+
+static struct vga_switcheroo_handler gmux_handler = {
+	.switchto = gmux_switchto,
+	.switchddc = gmux_switchddc,
+	.power_state = gmux_set_power_state,
+	.init = gmux_init,
+	.get_client_id = gmux_get_client_id,
+};
+
+static int gmux_interrupt_get_status(struct apple_gmux_data *gmux_data)
+{
+	lockdep_assert_held(&gmux_data->irq_lock);
+	return gmux_read8(gmux_data, GMUX_PORT_INTERRUPT_STATUS);
+}
+
+static void gmux_interrupt_ack(struct apple_gmux_data *gmux_data, int status)
+{
+	lockdep_assert_held(&gmux_data->irq_lock);
+	/* to reactivate interrupts write back current status */
+	gmux_write8(gmux_data, GMUX_PORT_INTERRUPT_STATUS, status);
+}
+
+static void gmux_handle_power_irq(struct apple_gmux_data *gmux_data,
+				  ktime_t irq_time)
+{
+	struct gmux_gpu *gpu = gmux_data->discrete;
+	bool stale;
+
+	/* only the GPU behind the gmux raises power interrupts */
+	if (!gpu)
+		return;
+
+	/* latched before the transition in progress was started */
+	spin_lock(&gpu->power_lock);
+	stale = !gmux_power_settled(gpu) &&
+		ktime_us_delta(gpu->power_start, irq_time) > 0;
+	spin_unlock(&gpu->power_lock);
+	if (stale)
+		return;
+
+	gpu->power_irq_us = ktime_us_delta(ktime_get(), irq_time);
+	gmux_power_complete(gpu, false);
+}
+
+static void gmux_handle_display_irq(struct apple_gmux_data *gmux_data)
+{
+	/* the firmware may adjust the brightness on a display change */
+	gmux_brightness_invalidate(gmux_data);
+
+	/* re-read right away so userspace learns of the change */
+	mutex_lock(&gmux_data->mux_lock);
+	gmux_data->mux_stale = true;
+	gmux_mux_sync(gmux_data);
+	mutex_unlock(&gmux_data->mux_lock);
+}
+
+/*
+ * Something was plugged into or removed from the external port. Only the
+ * external mux is touched here, and the discrete GPU is only powered up
+ * if the external port is routed to it. Userspace is told right away so
+ * it doesn't have to wait for the DRM connectors to be reprobed.
+ */
+static void gmux_handle_hotplug_irq(struct apple_gmux_data *gmux_data)
+{
+	enum vga_switcheroo_client_id id, external;
+
+	gmux_brightness_invalidate(gmux_data);
+	gmux_mux_invalidate(gmux_data);
+
+	if (!hotplug_route) {
+		gmux_uevent(gmux_data, "hotplug", NULL);
+		return;
+	}
+
+	/* stages take mux_lock themselves, queue them after dropping it */
+	mutex_lock(&gmux_data->mux_lock);
+	gmux_mux_sync(gmux_data);
+	if (hotplug_route == 2)
+		id = VGA_SWITCHEROO_DIS;
+	else
+		id = gmux_client_from_mux(gmux_data->display_shadow);
+	external = gmux_client_from_mux(gmux_data->external_shadow);
+	mutex_unlock(&gmux_data->mux_lock);
+
+	gmux_uevent(gmux_data, "hotplug", id == VGA_SWITCHEROO_IGD ?
+		    "GMUX_EXTERNAL=IGD" : "GMUX_EXTERNAL=DIS");
+
+	if (external == id)
+		return;
+
+	if (id == VGA_SWITCHEROO_DIS)
+		gmux_queue_stage(gmux_data, GMUX_STAGE_POWER, id,
+				 VGA_SWITCHEROO_ON);
+	gmux_queue_stage(gmux_data, GMUX_STAGE_EXTERNAL, id, VGA_SWITCHEROO_ON);
+}
+
+/*
+ * Bottom half of the gmux interrupt, dispatches whatever status bits have
+ * been latched by gmux_notify_handler() since it last ran.
+ */
+static void gmux_irq_work_func(struct work_struct *work)
+{
+	struct apple_gmux_data *gmux_data =
+		container_of(work, struct apple_gmux_data, irq_work.work);
+	ktime_t irq_time;
+	int status;
+
+	spin_lock_irq(&gmux_data->irq_lock);
+	status = gmux_data->irq_status;
+	irq_time = gmux_data->irq_time;
+	gmux_data->irq_status = 0;
+	spin_unlock_irq(&gmux_data->irq_lock);
+
+	gmux_dbg("irq", "status %#x\n", status);
+
+	if (status & GMUX_INTERRUPT_STATUS_POWER)
+		gmux_handle_power_irq(gmux_data, irq_time);
+	if (status & GMUX_INTERRUPT_STATUS_DISPLAY)
+		gmux_handle_display_irq(gmux_data);
+	if (status & GMUX_INTERRUPT_STATUS_HOTPLUG)
+		gmux_handle_hotplug_irq(gmux_data);
+}
+
+/* Read, acknowledge and latch the interrupt status for the bottom half */
+static int gmux_irq_latch(struct apple_gmux_data *gmux_data)
+{
+	int status;
+
+	lockdep_assert_held(&gmux_data->irq_lock);
+	status = gmux_interrupt_get_status(gmux_data);
+	if (status == GMUX_INTERRUPT_STATUS_ACTIVE)
+		return status;
+
+	gmux_interrupt_ack(gmux_data, status);
+	if (status & GMUX_INTERRUPT_STATUS_POWER)
+		gmux_data->irq_time = ktime_get();
+	gmux_data->irq_status |= status;
+	return status;
+}
+
+/*
+ * Hand latched status to gmux_irq_work_func(). A power interrupt has a
+ * waiter and is handled right away, display and hotplug interrupts are
+ * collected for irq_coalesce_ms so a bouncing line costs a single pass.
+ */
+static void gmux_irq_dispatch(struct apple_gmux_data *gmux_data, int status)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gmux_data->stats.irqs); i++)
+		if (status & (1 << i))
+			atomic_inc(&gmux_data->stats.irqs[i]);
+	trace_gmux_irq(status);
+
+	if (status & GMUX_INTERRUPT_STATUS_POWER)
+		mod_delayed_work(system_wq, &gmux_data->irq_work, 0);
+	else if (!schedule_delayed_work(&gmux_data->irq_work,
+					msecs_to_jiffies(irq_coalesce_ms)))
+		atomic_inc(&gmux_data->stats.irqs_coalesced);
+}
+
+/*
+ * Polls the status port while interrupts are off after a storm, see
+ * gmux_notify_handler().
+ */
+static void gmux_irq_poll_work_func(struct work_struct *work)
+{
+	struct apple_gmux_data *gmux_data =
+		container_of(work, struct apple_gmux_data, irq_poll_work.work);
+	int status;
+
+	spin_lock_irq(&gmux_data->irq_lock);
+	status = gmux_irq_latch(gmux_data);
+	if (status != GMUX_INTERRUPT_STATUS_ACTIVE)
+		gmux_data->irq_quiet_ms = 0;
+	else
+		gmux_data->irq_quiet_ms += GMUX_IRQ_POLL_MS;
+
+	if (gmux_data->irq_quiet_ms >= GMUX_IRQ_QUIET_MS) {
+		gmux_data->irq_polling = false;
+		gmux_data->irq_window = jiffies;
+		gmux_data->irq_count = 0;
+		gmux_irq_program(gmux_data);
+	}
+	spin_unlock_irq(&gmux_data->irq_lock);
+
+	if (status != GMUX_INTERRUPT_STATUS_ACTIVE)
+		gmux_irq_dispatch(gmux_data, status);
+
+	if (gmux_data->irq_polling)
+		schedule_delayed_work(&gmux_data->irq_poll_work,
+				      msecs_to_jiffies(GMUX_IRQ_POLL_MS));
+	else
+		pr_info("gmux interrupts quiet again, stopped polling\n");
+}
+
+/*
+ * Called from ACPI notify context, which also delays other ACPI events.
+ * Only latch and acknowledge the status here and leave the rest to
+ * gmux_irq_work_func().
+ *
+ * A flaky hotplug line can raise interrupts faster than they can be
+ * handled. Above irq_storm_threshold interrupts a second they are turned
+ * off in the gmux and the status port is polled at a low rate instead.
+ */
+static void gmux_notify_handler(acpi_handle device, u32 value, void *context)
+{
+	struct apple_gmux_data *gmux_data = context;
+	unsigned long flags;
+	bool storm = false;
+	int status;
+
+	spin_lock_irqsave(&gmux_data->irq_lock, flags);
+	status = gmux_irq_latch(gmux_data);
+	if (status == GMUX_INTERRUPT_STATUS_ACTIVE) {
+		spin_unlock_irqrestore(&gmux_data->irq_lock, flags);
+		return;
+	}
+
+	if (time_after(jiffies, gmux_data->irq_window + HZ)) {
+		gmux_data->irq_window = jiffies;
+		gmux_data->irq_count = 0;
+	}
+	if (irq_storm_threshold && !gmux_data->irq_polling &&
+	    ++gmux_data->irq_count > irq_storm_threshold) {
+		gmux_data->irq_polling = true;
+		gmux_data->irq_quiet_ms = 0;
+		gmux_irq_program(gmux_data);
+		storm = true;
+	}
+	spin_unlock_irqrestore(&gmux_data->irq_lock, flags);
+
+	gmux_irq_dispatch(gmux_data, status);
+
+	if (storm) {
+		pr_warn("gmux interrupt storm, polling the interrupt status\n");
+		atomic_inc(&gmux_data->stats.irq_storms);
+		schedule_delayed_work(&gmux_data->irq_poll_work,
+				      msecs_to_jiffies(GMUX_IRQ_POLL_MS));
+	}
+}
+
+/*
+ * Stop the interrupt bottom half and storm polling. The notify handler
+ * must already be gone so nothing queues them again.
+ */
+static void gmux_irq_cancel(struct apple_gmux_data *gmux_data)
+{
+	/* the poll work may turn interrupts back on */
+	cancel_delayed_work_sync(&gmux_data->irq_poll_work);
+	gmux_disable_interrupts(gmux_data);
+	gmux_data->irq_polling = false;
+	cancel_delayed_work_sync(&gmux_data->irq_work);
+}
+
+static ssize_t gmux_show_switch_state(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct apple_gmux_data *gmux_data = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n",
+		       gmux_switch_idle(gmux_data) ? "idle" : "busy");
+}
+
+static DEVICE_ATTR(switch_state, S_IRUGO, gmux_show_switch_state, NULL);
+
+static const char * const gmux_power_names[] = {
+	[GMUX_POWER_OFF] = "off",
+	[GMUX_POWER_POWERING_UP] = "powering-up",
+	[GMUX_POWER_ON] = "on",
+	[GMUX_POWER_POWERING_DOWN] = "powering-down",
+};
+
+/* pollable, notified on every transition of the discrete GPU */
+static ssize_t gmux_show_power_state(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct apple_gmux_data *gmux_data = dev_get_drvdata(dev);
+	struct gmux_gpu *gpu = gmux_data->discrete;
+
+	if (!gpu)
+		return sprintf(buf, "none\n");
+	return sprintf(buf, "%s\n",
+		       gmux_power_names[ACCESS_ONCE(gpu->power_state)]);
+}
+
+static DEVICE_ATTR(power_state, S_IRUGO, gmux_show_power_state, NULL);
+
+/* "<display> <external>", pollable, notified when a mux reads back changed */
+static ssize_t gmux_show_mux(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct apple_gmux_data *gmux_data = dev_get_drvdata(dev);
+	ssize_t len;
+
+	mutex_lock(&gmux_data->mux_lock);
+	gmux_mux_sync(gmux_data);
+	len = sprintf(buf, "%s %s\n",
+		      gmux_mux_name(gmux_data->display_shadow),
+		      gmux_mux_name(gmux_data->external_shadow));
+	mutex_unlock(&gmux_data->mux_lock);
+
+	return len;
+}
+
+static DEVICE_ATTR(mux, S_IRUGO, gmux_show_mux, NULL);
+
+static ssize_t gmux_store_prepare(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct apple_gmux_data *gmux_data = dev_get_drvdata(dev);
+
+	if (sysfs_streq(buf, "IGD"))
+		gmux_prepare(gmux_data, VGA_SWITCHEROO_IGD);
+	else if (sysfs_streq(buf, "DIS"))
+		gmux_prepare(gmux_data, VGA_SWITCHEROO_DIS);
+	else
+		return -EINVAL;
+
+	return count;
+}
+
+static DEVICE_ATTR(prepare, S_IWUSR, NULL, gmux_store_prepare);
+
+/* for debugging: bypass the shadow copy and ask the hardware */
+static ssize_t gmux_show_brightness_hw(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct apple_gmux_data *gmux_data = dev_get_drvdata(dev);
+	u32 brightness;
+
+	spin_lock_irq(&gmux_data->bl_lock);
+	brightness = gmux_read_brightness(gmux_data);
+	spin_unlock_irq(&gmux_data->bl_lock);
+
+	return sprintf(buf, "%u\n", brightness);
+}
+
+static DEVICE_ATTR(brightness_hw, S_IRUSR, gmux_show_brightness_hw, NULL);
+
+/* "<target> <duration in ms>" */
+static ssize_t gmux_store_brightness_ramp(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct apple_gmux_data *gmux_data = dev_get_drvdata(dev);
+	unsigned int target, duration;
+	int ret;
+
+	if (sscanf(buf, "%u %u", &target, &duration) != 2)
+		return -EINVAL;
+
+	ret = gmux_start_ramp(gmux_data, target, duration);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(brightness_ramp, S_IWUSR, NULL,
+		   gmux_store_brightness_ramp);
+
+static struct attribute *gmux_attrs[] = {
+	&dev_attr_switch_state.attr,
+	&dev_attr_power_state.attr,
+	&dev_attr_mux.attr,
+	&dev_attr_prepare.attr,
+	&dev_attr_brightness_hw.attr,
+	&dev_attr_brightness_ramp.attr,
+	NULL
+};
+
+static const struct attribute_group gmux_attr_group = {
+	.attrs = gmux_attrs,
+};
+
+static const char * const gmux_lat_names[GMUX_LAT_NR] = {
+	[GMUX_LAT_SWITCH] = "switch",
+	[GMUX_LAT_POWER_UP] = "power_up",
+	[GMUX_LAT_POWER_DOWN] = "power_down",
+	[GMUX_LAT_BRIGHTNESS] = "brightness",
+};
+
+static int gmux_latency_show(struct seq_file *m, void *unused)
+{
+	struct apple_gmux_data *gmux_data = m->private;
+	struct gmux_lat_hist hist;
+	int op, i;
+
+	for (op = 0; op < GMUX_LAT_NR; op++) {
+		spin_lock_irq(&gmux_data->lat_lock);
+		hist = gmux_data->lat[op];
+		spin_unlock_irq(&gmux_data->lat_lock);
+
+		seq_printf(m, "%s: count %llu avg %llu us max %llu us\n",
+			   gmux_lat_names[op], hist.count,
+			   hist.count ? div64_u64(hist.total_us, hist.count) : 0,
+			   hist.max_us);
+		for (i = 0; i < GMUX_LAT_BUCKETS; i++) {
+			if (!hist.buckets[i])
+				continue;
+			seq_printf(m, "  %8lu us: %llu\n",
+				   i ? 1UL << i : 0UL, hist.buckets[i]);
+		}
+	}
+
+	return 0;
+}
+
+static int gmux_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gmux_latency_show, inode->i_private);
+}
+
+/* any write clears the histograms */
+static ssize_t gmux_latency_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct apple_gmux_data *gmux_data = m->private;
+
+	spin_lock_irq(&gmux_data->lat_lock);
+	memset(gmux_data->lat, 0, sizeof(gmux_data->lat));
+	spin_unlock_irq(&gmux_data->lat_lock);
+
+	return count;
+}
+
+static const struct file_operations gmux_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = gmux_latency_open,
+	.read = seq_read,
+	.write = gmux_latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* All known registers, for the debugfs register dump */
+static const struct {
+	const char *name;
+	int port;
+	int width;
+} gmux_registers[] = {
+	{ "VERSION_MAJOR", GMUX_PORT_VERSION_MAJOR, 8 },
+	{ "VERSION_MINOR", GMUX_PORT_VERSION_MINOR, 8 },
+	{ "VERSION_RELEASE", GMUX_PORT_VERSION_RELEASE, 8 },
+	{ "SWITCH_DISPLAY", GMUX_PORT_SWITCH_DISPLAY, 8 },
+	{ "SWITCH_GET_DISPLAY", GMUX_PORT_SWITCH_GET_DISPLAY, 8 },
+	{ "INTERRUPT_ENABLE", GMUX_PORT_INTERRUPT_ENABLE, 8 },
+	{ "INTERRUPT_STATUS", GMUX_PORT_INTERRUPT_STATUS, 8 },
+	{ "SWITCH_DDC", GMUX_PORT_SWITCH_DDC, 8 },
+	{ "SWITCH_EXTERNAL", GMUX_PORT_SWITCH_EXTERNAL, 8 },
+	{ "SWITCH_GET_EXTERNAL", GMUX_PORT_SWITCH_GET_EXTERNAL, 8 },
+	{ "DISCRETE_POWER", GMUX_PORT_DISCRETE_POWER, 8 },
+	{ "MAX_BRIGHTNESS", GMUX_PORT_MAX_BRIGHTNESS, 32 },
+	{ "BRIGHTNESS", GMUX_PORT_BRIGHTNESS, 32 },
+};
+
+/*
+ * Read through the backend directly, so that looking at the registers
+ * doesn't show up in the counters or the port tracepoints.
+ */
+static int gmux_registers_show(struct seq_file *m, void *unused)
+{
+	struct apple_gmux_data *gmux_data = m->private;
+	u32 val;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gmux_registers); i++) {
+		int port = gmux_registers[i].port;
+
+		if (gmux_registers[i].width == 32) {
+			spin_lock_irq(&gmux_data->bl_lock);
+			val = gmux_data->ops->read32(gmux_data, port);
+			spin_unlock_irq(&gmux_data->bl_lock);
+			seq_printf(m, "%#04x %-20s %#010x\n", port,
+				   gmux_registers[i].name, val);
+		} else {
+			val = gmux_data->ops->read8(gmux_data, port);
+			seq_printf(m, "%#04x %-20s %#04x\n", port,
+				   gmux_registers[i].name, val);
+		}
+	}
+
+	return 0;
+}
+
+static int gmux_registers_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gmux_registers_show, inode->i_private);
+}
+
+static const struct file_operations gmux_registers_fops = {
+	.owner = THIS_MODULE,
+	.open = gmux_registers_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const char * const gmux_irq_names[8] = {
+	[0] = "display",
+	[2] = "power",
+	[3] = "hotplug",
+};
+
+static int gmux_stats_show(struct seq_file *m, void *unused)
+{
+	struct apple_gmux_data *gmux_data = m->private;
+	struct gmux_stats *stats = &gmux_data->stats;
+	int i;
+
+	seq_printf(m, "reads: %d\n", atomic_read(&stats->reads));
+	seq_printf(m, "writes: %d\n", atomic_read(&stats->writes));
+	for (i = 0; i < ARRAY_SIZE(stats->irqs); i++) {
+		if (gmux_irq_names[i])
+			seq_printf(m, "irq_%s: %d\n", gmux_irq_names[i],
+				   atomic_read(&stats->irqs[i]));
+		else if (atomic_read(&stats->irqs[i]))
+			seq_printf(m, "irq_bit%d: %d\n", i,
+				   atomic_read(&stats->irqs[i]));
+	}
+	seq_printf(m, "power_timeouts: %d\n",
+		   atomic_read(&stats->power_timeouts));
+	seq_printf(m, "pwrd_failures: %d\n",
+		   atomic_read(&stats->pwrd_failures));
+	seq_printf(m, "mux_writes_skipped: %d\n",
+		   atomic_read(&stats->mux_writes_skipped));
+	seq_printf(m, "power_downs_deferred: %d\n",
+		   atomic_read(&stats->power_downs_deferred));
+	seq_printf(m, "power_cycles_avoided: %d\n",
+		   atomic_read(&stats->power_cycles_avoided));
+	seq_printf(m, "irqs_coalesced: %d\n",
+		   atomic_read(&stats->irqs_coalesced));
+	seq_printf(m, "irq_storms: %d\n", atomic_read(&stats->irq_storms));
+	seq_printf(m, "xfer_errors: %d\n", atomic_read(&stats->xfer_errors));
+	seq_printf(m, "bl_superseded: %d\n",
+		   atomic_read(&stats->bl_superseded));
+	seq_printf(m, "irq_polling: %d\n", gmux_data->irq_polling);
+
+	return 0;
+}
+
+static int gmux_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gmux_stats_show, inode->i_private);
+}
+
+/* any write clears the counters */
+static ssize_t gmux_stats_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct apple_gmux_data *gmux_data = m->private;
+	struct gmux_stats *stats = &gmux_data->stats;
+	int i;
+
+	atomic_set(&stats->reads, 0);
+	atomic_set(&stats->writes, 0);
+	for (i = 0; i < ARRAY_SIZE(stats->irqs); i++)
+		atomic_set(&stats->irqs[i], 0);
+	atomic_set(&stats->power_timeouts, 0);
+	atomic_set(&stats->pwrd_failures, 0);
+	atomic_set(&stats->mux_writes_skipped, 0);
+	atomic_set(&stats->power_downs_deferred, 0);
+	atomic_set(&stats->power_cycles_avoided, 0);
+	atomic_set(&stats->irqs_coalesced, 0);
+	atomic_set(&stats->irq_storms, 0);
+	atomic_set(&stats->xfer_errors, 0);
+	atomic_set(&stats->bl_superseded, 0);
+
+	return count;
+}
+
+static const struct file_operations gmux_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = gmux_stats_open,
+	.read = seq_read,
+	.write = gmux_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Benchmarks, started by writing "<test> <iterations>" to the debugfs
+ * bench file and reported by reading it back:
+ *
+ *   power       cycles the discrete GPU off and on
+ *   switch      switches the panel between IGD and DIS
+ *   brightness  ramps the brightness over its full range
+ *
+ * These really drive the hardware and should only be run on an otherwise
+ * idle machine. The state from before the run is restored afterwards.
+ * The power and switch tests go around the DRM drivers, so on real
+ * hardware they refuse to run unless the discrete GPU is on, drives
+ * neither the panel nor the external port and has no driver bound.
+ */
+#define GMUX_BENCH_MAX_ITERATIONS	10000
+
+static int gmux_bench_check_idle(struct apple_gmux_data *gmux_data)
+{
+	struct gmux_gpu *gpu = gmux_data->discrete;
+	bool routed;
+
+	if (!gpu)
+		return -ENODEV;
+	if (gmux_data->emu)
+		return 0;
+
+	gmux_wait_for_switch(gmux_data);
+	mutex_lock(&gmux_data->mux_lock);
+	gmux_mux_sync(gmux_data);
+	routed = gmux_data->display_shadow == gmux_mux_val(VGA_SWITCHEROO_DIS) ||
+		 gmux_data->external_shadow == gmux_mux_val(VGA_SWITCHEROO_DIS);
+	mutex_unlock(&gmux_data->mux_lock);
+
+	if (routed || (gpu->pdev && gpu->pdev->dev.driver) ||
+	    ACCESS_ONCE(gpu->power_state) != GMUX_POWER_ON)
+		return -EBUSY;
+	return 0;
+}
+
+static int gmux_bench_cmp(const void *a, const void *b)
+{
+	s64 x = *(const s64 *)a, y = *(const s64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int gmux_bench_report(char *buf, size_t len, const char *name,
+			     s64 *samples, int n)
+{
+	if (!n)
+		return scnprintf(buf, len, "%s: no samples\n", name);
+
+	sort(samples, n, sizeof(*samples), gmux_bench_cmp, NULL);
+	return scnprintf(buf, len,
+			 "%s: n %d min %lld median %lld p99 %lld us\n", name,
+			 n, samples[0], samples[n / 2],
+			 samples[min(n - 1, n * 99 / 100)]);
+}
+
+static int gmux_bench_power(struct apple_gmux_data *gmux_data, int n,
+			    char *buf, size_t len)
+{
+	struct gmux_gpu *gpu = gmux_data->discrete;
+	s64 *up, *down, *irq;
+	int i, nirq = 0, off;
+	bool was_on;
+	ktime_t start;
+	int ret;
+
+	ret = gmux_bench_check_idle(gmux_data);
+	if (ret)
+		return ret;
+
+	up = kcalloc(3 * n, sizeof(*up), GFP_KERNEL);
+	if (!up)
+		return -ENOMEM;
+	down = up + n;
+	irq = down + n;
+
+	gmux_wait_for_power(gpu);
+	was_on = ACCESS_ONCE(gpu->power_state) == GMUX_POWER_ON;
+
+	for (i = 0; i < n; i++) {
+		gpu->power_irq_us = -1;
+		start = ktime_get();
+		gmux_set_discrete_state(gpu, VGA_SWITCHEROO_OFF, true);
+		down[i] = ktime_us_delta(ktime_get(), start);
+		if (gpu->power_irq_us >= 0)
+			irq[nirq++] = gpu->power_irq_us;
+
+		gpu->power_irq_us = -1;
+		start = ktime_get();
+		gmux_set_discrete_state(gpu, VGA_SWITCHEROO_ON, true);
+		up[i] = ktime_us_delta(ktime_get(), start);
+		if (gpu->power_irq_us >= 0)
+			irq[nirq++] = gpu->power_irq_us;
+	}
+
+	if (!was_on)
+		gmux_set_discrete_state(gpu, VGA_SWITCHEROO_OFF, true);
+
+	off = gmux_bench_report(buf, len, "power_down", down, n);
+	off += gmux_bench_report(buf + off, len - off, "power_up", up, n);
+	off += gmux_bench_report(buf + off, len - off, "irq_to_complete",
+				 irq, nirq);
+
+	kfree(up);
+	return 0;
+}
+
+static int gmux_bench_switch(struct apple_gmux_data *gmux_data, int n,
+			     char *buf, size_t len)
+{
+	enum vga_switcheroo_client_id orig, id;
+	s64 *samples;
+	ktime_t start;
+	int i, ret;
+
+	ret = gmux_bench_check_idle(gmux_data);
+	if (ret)
+		return ret;
+
+	samples = kcalloc(n, sizeof(*samples), GFP_KERNEL);
+	if (!samples)
+		return -ENOMEM;
+
+	gmux_wait_for_switch(gmux_data);
+	orig = gmux_client_from_mux(gmux_read8(gmux_data,
+					       GMUX_PORT_SWITCH_GET_DISPLAY));
+
+	for (i = 0; i < n; i++) {
+		id = (i & 1) == (orig == VGA_SWITCHEROO_IGD) ?
+			VGA_SWITCHEROO_IGD : VGA_SWITCHEROO_DIS;
+		start = ktime_get();
+		gmux_queue_switch(gmux_data, id);
+		gmux_wait_for_switch(gmux_data);
+		samples[i] = ktime_us_delta(ktime_get(), start);
+	}
+
+	if (id != orig) {
+		gmux_queue_switch(gmux_data, orig);
+		gmux_wait_for_switch(gmux_data);
+	}
+
+	gmux_bench_report(buf, len, "switch", samples, n);
+	kfree(samples);
+	return 0;
+}
+
+static int gmux_bench_brightness(struct apple_gmux_data *gmux_data, int n,
+				 char *buf, size_t len)
+{
+	struct backlight_device *bd = gmux_data->bdev;
+	int orig = bd->props.brightness;
+	s64 *samples;
+	ktime_t start;
+	int i;
+
+	samples = kcalloc(n, sizeof(*samples), GFP_KERNEL);
+	if (!samples)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		bd->props.brightness = div_u64((u64)bd->props.max_brightness *
+					       (i + 1), n);
+		start = ktime_get();
+		gmux_update_status(bd);
+		flush_delayed_work(&gmux_data->bl_work);
+		samples[i] = ktime_us_delta(ktime_get(), start);
+	}
+
+	bd->props.brightness = orig;
+	gmux_update_status(bd);
+
+	gmux_bench_report(buf, len, "brightness", samples, n);
+	kfree(samples);
+	return 0;
+}
+
+static ssize_t gmux_bench_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct apple_gmux_data *gmux_data = file->private_data;
+	ssize_t ret;
+
+	mutex_lock(&gmux_data->bench_lock);
+	ret = simple_read_from_buffer(buf, count, ppos,
+				      gmux_data->bench_result,
+				      strlen(gmux_data->bench_result));
+	mutex_unlock(&gmux_data->bench_lock);
+
+	return ret;
+}
+
+static ssize_t gmux_bench_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct apple_gmux_data *gmux_data = file->private_data;
+	char *result = gmux_data->bench_result;
+	size_t len = sizeof(gmux_data->bench_result);
+	char cmd[32], test[16];
+	int n, ret;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+
+	if (sscanf(cmd, "%15s %d", test, &n) != 2 ||
+	    n <= 0 || n > GMUX_BENCH_MAX_ITERATIONS)
+		return -EINVAL;
+
+	mutex_lock(&gmux_data->bench_lock);
+	result[0] = '\0';
+	if (!strcmp(test, "power"))
+		ret = gmux_bench_power(gmux_data, n, result, len);
+	else if (!strcmp(test, "switch"))
+		ret = gmux_bench_switch(gmux_data, n, result, len);
+	else if (!strcmp(test, "brightness"))
+		ret = gmux_bench_brightness(gmux_data, n, result, len);
+	else
+		ret = -EINVAL;
+	mutex_unlock(&gmux_data->bench_lock);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations gmux_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = gmux_bench_read,
+	.write = gmux_bench_write,
+	.llseek = default_llseek,
+};
+
+/*
+ * Measured power transition times of this machine, along with the
+ * firmware version they were measured on, for tuning the timeouts.
+ */
+static int gmux_power_profile_show(struct seq_file *m, void *unused)
+{
+	struct apple_gmux_data *gmux_data = m->private;
+	struct gmux_gpu *gpu = gmux_data->discrete;
+	static const char * const names[] = { "power_down", "power_up" };
+	struct gmux_power_profile prof[2];
+	int i;
+
+	seq_printf(m, "version: %d.%d.%d\n", gmux_data->version >> 16,
+		   (gmux_data->version >> 8) & 0xff, gmux_data->version & 0xff);
+	if (power_timeout_ms)
+		seq_printf(m, "timeout: fixed %u ms\n", power_timeout_ms);
+	else
+		seq_printf(m, "timeout: adaptive\n");
+	if (!gpu)
+		return 0;
+
+	spin_lock(&gpu->power_lock);
+	memcpy(prof, gpu->power_profile, sizeof(prof));
+	spin_unlock(&gpu->power_lock);
+
+	for (i = 0; i < ARRAY_SIZE(prof); i++) {
+		unsigned int timeout = prof[i].count >= GMUX_POWER_MIN_SAMPLES ?
+				       prof[i].timeout_ms : GMUX_POWER_TIMEOUT_MS;
+
+		if (power_timeout_ms)
+			timeout = power_timeout_ms;
+		seq_printf(m, "%s: n %u p50 %u p99 %u us timeout %u ms\n",
+			   names[i], prof[i].count, prof[i].p50_us,
+			   prof[i].p99_us, timeout);
+	}
+
+	return 0;
+}
+
+static int gmux_power_profile_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gmux_power_profile_show, inode->i_private);
+}
+
+static const struct file_operations gmux_power_profile_fops = {
+	.owner = THIS_MODULE,
+	.open = gmux_power_profile_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* debugfs is optional, failures to set it up are ignored */
+static void gmux_debugfs_init(struct apple_gmux_data *gmux_data)
+{
+	if (!gmux_debugfs_root)
+		return;
+
+	gmux_data->debugfs = debugfs_create_dir(dev_name(gmux_data->dev),
+						gmux_debugfs_root);
+	if (IS_ERR_OR_NULL(gmux_data->debugfs)) {
+		gmux_data->debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("latency", S_IRUSR | S_IWUSR, gmux_data->debugfs,
+			    gmux_data, &gmux_latency_fops);
+	debugfs_create_file("registers", S_IRUSR, gmux_data->debugfs,
+			    gmux_data, &gmux_registers_fops);
+	debugfs_create_file("stats", S_IRUSR | S_IWUSR, gmux_data->debugfs,
+			    gmux_data, &gmux_stats_fops);
+	debugfs_create_file("bench", S_IRUSR | S_IWUSR, gmux_data->debugfs,
+			    gmux_data, &gmux_bench_fops);
+	debugfs_create_file("power_profile", S_IRUSR, gmux_data->debugfs,
+			    gmux_data, &gmux_power_profile_fops);
+}
+
+static const struct backlight_ops gmux_bl_ops = {
+	.get_brightness = gmux_get_brightness,
+	.update_status = gmux_update_status,
+};
+
+static void gmux_take_snapshot(struct apple_gmux_data *gmux_data,
+			       struct gmux_snapshot *snap)
+{
+	struct gmux_xfer_op xfer[] = {
+		GMUX_XFER_R8(GMUX_PORT_SWITCH_GET_DISPLAY),
+		GMUX_XFER_R8(GMUX_PORT_SWITCH_DDC),
+		GMUX_XFER_R8(GMUX_PORT_SWITCH_GET_EXTERNAL),
+		GMUX_XFER_R8(GMUX_PORT_DISCRETE_POWER),
+	};
+
+	gmux_xfer(gmux_data, "snapshot", xfer, ARRAY_SIZE(xfer));
+	snap->display = xfer[0].result;
+	snap->ddc = xfer[1].result;
+	snap->external = xfer[2].result;
+	snap->power = xfer[3].result;
+
+	spin_lock_irq(&gmux_data->bl_lock);
+	snap->brightness = gmux_read_brightness(gmux_data);
+	spin_unlock_irq(&gmux_data->bl_lock);
+}
+
+/*
+ * The parts of probing nothing depends on, run outside of the boot
+ * critical path once the gmux is usable.
+ */
+static void gmux_probe_async(void *data, async_cookie_t cookie)
+{
+	struct apple_gmux_data *gmux_data = data;
+
+	/* write back what was read at probe, or what was set since */
+	backlight_update_status(gmux_data->bdev);
+
+	if (gmux_data->dhandle) {
+		struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
+
+		acpi_get_name(gmux_data->dhandle, ACPI_SINGLE_NAME, &buf);
+		pr_info("Found acpi handle for %s: %s\n",
+			dev_name(gmux_data->dev), (char *)buf.pointer);
+		kfree(buf.pointer);
+	}
+}
+
+static void gmux_probe_async_sync(struct apple_gmux_data *gmux_data)
+{
+	async_synchronize_cookie(gmux_data->async_cookie + 1);
+}
+
+static int gmux_suspend(struct apple_gmux_data *gmux_data)
+{
+	gmux_probe_async_sync(gmux_data);
+
+	/*
+	 * Our workqueues aren't frozen, keep the policy and the storm poll
+	 * from switching or powering anything once the state is saved.
+	 * Interrupts come back unthrottled on resume.
+	 */
+	gmux_policy_stop(gmux_data);
+	cancel_delayed_work_sync(&gmux_data->irq_poll_work);
+	spin_lock_irq(&gmux_data->irq_lock);
+	gmux_data->irq_polling = false;
+	gmux_data->irq_window = jiffies;
+	gmux_data->irq_count = 0;
+	spin_unlock_irq(&gmux_data->irq_lock);
+	flush_delayed_work(&gmux_data->irq_work);
+
+	/* let a switch in progress finish before saving the state */
+	gmux_wait_for_switch(gmux_data);
+	if (hrtimer_cancel(&gmux_data->bl_ramp_timer)) {
+		/* jump to the end of an unfinished ramp */
+		spin_lock_irq(&gmux_data->bl_lock);
+		gmux_write_brightness(gmux_data, gmux_data->bl_ramp_to);
+		gmux_data->bl_shadow = gmux_data->bl_ramp_to;
+		spin_unlock_irq(&gmux_data->bl_lock);
+	}
+	flush_delayed_work(&gmux_data->bl_work);
+	if (gmux_data->discrete)
+		flush_delayed_work(&gmux_data->discrete->power_down_work);
+
+	gmux_take_snapshot(gmux_data, &gmux_data->resume_state);
+	return 0;
+}
+
+/*
+ * Bring the gmux back to the state saved at suspend. Only the registers
+ * whose read-back value differs from the snapshot are written. The gmux
+ * has its resume callback run asynchronously, so this doesn't hold up the
+ * rest of the system while it waits for the discrete GPU.
+ */
+static int gmux_resume(struct apple_gmux_data *gmux_data)
+{
+	struct gmux_snapshot *saved = &gmux_data->resume_state;
+	struct gmux_gpu *gpu = gmux_data->discrete;
+	struct gmux_snapshot now;
+
+	/*
+	 * The firmware may have reset the interrupt enable port, forget the
+	 * cached mask and write it out again before anything waits on an
+	 * interrupt.
+	 */
+	spin_lock_irq(&gmux_data->irq_lock);
+	gmux_data->irq_mask = -1;
+	gmux_irq_program(gmux_data);
+	spin_unlock_irq(&gmux_data->irq_lock);
+
+	gmux_take_snapshot(gmux_data, &now);
+
+	if (gpu && !now.power != !saved->power) {
+		/* force a full power sequence towards the saved state */
+		spin_lock(&gpu->power_lock);
+		gpu->power_state = now.power ? GMUX_POWER_ON : GMUX_POWER_OFF;
+		spin_unlock(&gpu->power_lock);
+		gmux_set_discrete_state(gpu, saved->power ? VGA_SWITCHEROO_ON :
+							    VGA_SWITCHEROO_OFF,
+					true);
+	}
+
+	mutex_lock(&gmux_data->mux_lock);
+	gmux_data->mux_stale = true;
+	if (now.ddc != saved->ddc)
+		gmux_write_ddc(gmux_data, saved->ddc == 1 ? VGA_SWITCHEROO_IGD :
+							    VGA_SWITCHEROO_DIS);
+	if (now.display != saved->display)
+		gmux_switch_display(gmux_data,
+				    gmux_client_from_mux(saved->display));
+	if (now.external != saved->external)
+		gmux_switch_external(gmux_data,
+				     gmux_client_from_mux(saved->external));
+	mutex_unlock(&gmux_data->mux_lock);
+
+	spin_lock_irq(&gmux_data->bl_lock);
+	if (!gmux_data->bl_dirty && now.brightness != saved->brightness)
+		gmux_write_brightness(gmux_data, saved->brightness);
+	gmux_data->bl_shadow = saved->brightness;
+	gmux_data->bl_stale = false;
+	spin_unlock_irq(&gmux_data->bl_lock);
+
+	gmux_policy_start(gmux_data);
+	return 0;
+}
+
+static struct apple_gmux_data *gmux_alloc(struct device *dev)
+{
+	struct apple_gmux_data *gmux_data;
+
+	gmux_data = kzalloc(sizeof(*gmux_data), GFP_KERNEL);
+	if (!gmux_data)
+		return NULL;
+
+	dev_set_drvdata(dev, gmux_data);
+	gmux_data->dev = dev;
+	INIT_LIST_HEAD(&gmux_data->gpus);
+	spin_lock_init(&gmux_data->lat_lock);
+	mutex_init(&gmux_data->bench_lock);
+
+	return gmux_data;
+}
+
+static void gmux_free(struct apple_gmux_data *gmux_data)
+{
+	dev_set_drvdata(gmux_data->dev, NULL);
+	kfree(gmux_data);
+}
+
+/*
+ * Set up everything that doesn't depend on how the gmux is reached. The
+ * port backend has to be picked by the caller, the legacy backend is
+ * upgraded to the wide one here if the gmux version allows it.
+ */
+static int gmux_setup(struct apple_gmux_data *gmux_data)
+{
+	struct backlight_properties props;
+	struct backlight_device *bdev;
+	struct gmux_xfer_op version[] = {
+		GMUX_XFER_R8(GMUX_PORT_VERSION_MAJOR),
+		GMUX_XFER_R8(GMUX_PORT_VERSION_MINOR),
+		GMUX_XFER_R8(GMUX_PORT_VERSION_RELEASE),
+	};
+	u8 ver_major, ver_minor, ver_release;
+	int ret;
+
+	/*
+	 * On some machines the gmux is in ACPI even thought the machine
+	 * doesn't really have a gmux. Check for invalid version information
+	 * to detect this.
+	 */
+	gmux_xfer(gmux_data, "version", version, ARRAY_SIZE(version));
+	ver_major = version[0].result;
+	ver_minor = version[1].result;
+	ver_release = version[2].result;
+	if (ver_major == 0xff && ver_minor == 0xff && ver_release == 0xff) {
+		pr_info("gmux device not present\n");
+		return -ENODEV;
+	}
+
+	pr_info("Found gmux version %d.%d.%d\n", ver_major, ver_minor,
+		ver_release);
+
+	gmux_data->version = GMUX_VERSION(ver_major, ver_minor, ver_release);
+	if (gmux_data->ops == &gmux_legacy_ops &&
+	    (wide_io > 0 || (wide_io < 0 &&
+			     gmux_data->version >= GMUX_VERSION_WIDE_IO)))
+		gmux_data->ops = &gmux_wide_ops;
+	pr_info("Using %s port access\n", gmux_data->ops->name);
+
+	spin_lock_init(&gmux_data->bl_lock);
+	gmux_data->bl_dirty = false;
+	gmux_data->bl_stale = true;
+	gmux_data->bl_last_flush = jiffies;
+	INIT_DELAYED_WORK(&gmux_data->bl_work, gmux_brightness_work_func);
+	hrtimer_init(&gmux_data->bl_ramp_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	gmux_data->bl_ramp_timer.function = gmux_ramp_timer_func;
+
+	memset(&props, 0, sizeof(props));
+	props.type = BACKLIGHT_PLATFORM;
+	props.max_brightness = gmux_read32(gmux_data, GMUX_PORT_MAX_BRIGHTNESS);
+
+	/*
+	 * Old gmux versions take the brightness byte-wise with the upper
+	 * byte used as the flush, limiting it to 2^24. Firmware that takes
+	 * a single 32-bit write gets the full range, up to what the
+	 * backlight core can represent. Cap the max brightness at what the
+	 * backend can write, but print a warning if the hardware reports
+	 * something higher so that it can be fixed.
+	 */
+	if (WARN_ON((u32)props.max_brightness > gmux_data->ops->brightness_mask))
+		props.max_brightness = gmux_data->ops->brightness_mask;
+	if ((u32)props.max_brightness > INT_MAX)
+		props.max_brightness = INT_MAX;
+	if (props.max_brightness > GMUX_MAX_BRIGHTNESS)
+		pr_info("Using full brightness range (max %d)\n",
+			props.max_brightness);
+
+	bdev = backlight_device_register("gmux_backlight", gmux_data->dev,
+					 gmux_data, &gmux_bl_ops, &props);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	gmux_data->bdev = bdev;
+	bdev->props.brightness = gmux_get_brightness(bdev);
+
+	mutex_init(&gmux_data->mux_lock);
+	gmux_data->mux_stale = true;
+	atomic_set(&gmux_data->stages_pending, 0);
+	spin_lock_init(&gmux_data->stage_lock);
+	atomic_set(&gmux_data->stage_seq, 0);
+	atomic_set(&gmux_data->stage_done_seq, 0);
+	init_waitqueue_head(&gmux_data->switch_waitq);
+	gmux_data->wq = alloc_ordered_workqueue("apple_gmux", 0);
+	if (!gmux_data->wq) {
+		ret = -ENOMEM;
+		goto err_wq;
+	}
+
+	ret = sysfs_create_group(&gmux_data->dev->kobj, &gmux_attr_group);
+	if (ret)
+		goto err_sysfs;
+
+	mutex_init(&gmux_data->policy_lock);
+	INIT_DELAYED_WORK(&gmux_data->policy_work, gmux_policy_work_func);
+
+	spin_lock_init(&gmux_data->irq_lock);
+	gmux_data->irq_status = 0;
+	gmux_data->irq_window = jiffies;
+	/* unknown, forces the first write */
+	gmux_data->irq_mask = -1;
+	INIT_DELAYED_WORK(&gmux_data->irq_work, gmux_irq_work_func);
+	INIT_DELAYED_WORK(&gmux_data->irq_poll_work, gmux_irq_poll_work_func);
+
+	return 0;
+
+err_sysfs:
+	destroy_workqueue(gmux_data->wq);
+err_wq:
+	backlight_device_unregister(bdev);
+	cancel_delayed_work_sync(&gmux_data->bl_work);
+	return ret;
+}
+
+static void gmux_cleanup(struct apple_gmux_data *gmux_data)
+{
+	/* carry out whatever is still queued before going away */
+	destroy_workqueue(gmux_data->wq);
+	sysfs_remove_group(&gmux_data->dev->kobj, &gmux_attr_group);
+	gmux_stop_ramp(gmux_data);
+	backlight_device_unregister(gmux_data->bdev);
+	flush_delayed_work(&gmux_data->bl_work);
+}
+
+/* Make the gmux available once interrupts can be delivered */
+static int gmux_register(struct apple_gmux_data *gmux_data)
+{
+	/*
+	 * vga_switcheroo only takes a single handler, if there is more than
+	 * one gmux the first one drives the switching. The emulated gmux
+	 * never does: its registers don't move real muxes, and it must not
+	 * claim the PCI GPUs through gmux_get_client_id().
+	 */
+	if (gmux_data->emu) {
+		pr_info("emulated gmux, not registering with vga_switcheroo\n");
+	} else if (apple_gmux_data) {
+		pr_info("vga_switcheroo handled by another gmux\n");
+	} else {
+		apple_gmux_data = gmux_data;
+		if (vga_switcheroo_register_handler(&gmux_handler)) {
+			apple_gmux_data = NULL;
+			return -ENXIO;
+		}
+	}
+
+	gmux_debugfs_init(gmux_data);
+	device_enable_async_suspend(gmux_data->dev);
+	gmux_enable_interrupts(gmux_data);
+	gmux_policy_start(gmux_data);
+	gmux_data->async_cookie = async_schedule(gmux_probe_async, gmux_data);
+
+	return 0;
+}
+
+static void gmux_unregister(struct apple_gmux_data *gmux_data)
+{
+	gmux_probe_async_sync(gmux_data);
+	gmux_policy_stop(gmux_data);
+	debugfs_remove_recursive(gmux_data->debugfs);
+	if (apple_gmux_data == gmux_data) {
+		vga_switcheroo_unregister_handler();
+		apple_gmux_data = NULL;
+	}
+}
+
+static int gmux_pnp_suspend(struct pnp_dev *pnp, pm_message_t state)
+{
+	return gmux_suspend(pnp_get_drvdata(pnp));
+}
+
+static int gmux_pnp_resume(struct pnp_dev *pnp)
+{
+	return gmux_resume(pnp_get_drvdata(pnp));
+}
+
+static int __devinit gmux_probe(struct pnp_dev *pnp,
+				const struct pnp_device_id *id)
+{
+	struct apple_gmux_data *gmux_data;
+	struct resource *res;
+	acpi_status status;
+	int ret = -ENXIO;
+
+	gmux_data = gmux_alloc(&pnp->dev);
+	if (!gmux_data)
+		return -ENOMEM;
+
+	res = pnp_get_resource(pnp, IORESOURCE_IO, 0);
+	if (!res) {
+		pr_err("Failed to find gmux I/O resource\n");
+		goto err_free;
+	}
+
+	gmux_data->iostart = res->start;
+	gmux_data->iolen = res->end - res->start;
+
+	if (gmux_data->iolen < GMUX_MIN_IO_LEN) {
+		pr_err("gmux I/O region too small (%lu < %u)\n",
+		       gmux_data->iolen, GMUX_MIN_IO_LEN);
+		goto err_free;
+	}
+
+	if (!request_region(gmux_data->iostart, gmux_data->iolen,
+			    "Apple gmux")) {
+		pr_err("gmux I/O already in use\n");
+		goto err_free;
+	}
+
+	gmux_data->ops = &gmux_legacy_ops;
+
+	gmux_data->dhandle = DEVICE_ACPI_HANDLE(&pnp->dev);
+	if (!gmux_data->dhandle) {
+		pr_err("Cannot find acpi device for pnp device %s\n", dev_name(&pnp->dev));
+		goto err_release;
+	}
+
+	ret = gmux_setup(gmux_data);
+	if (ret)
+		goto err_release;
+	ret = -ENXIO;
+
+	status = acpi_install_notify_handler(gmux_data->dhandle, ACPI_DEVICE_NOTIFY, &gmux_notify_handler, gmux_data);
+	if (ACPI_FAILURE(status)) {
+		printk("Install notify handler failed: %s\n", acpi_format_exception(status));
+		goto err_notify;
+	}
+
+	ret = gmux_register(gmux_data);
+	if (ret)
+		goto err_register;
+
+	return 0;
+
+err_register:
+	status = acpi_remove_notify_handler(gmux_data->dhandle, ACPI_DEVICE_NOTIFY, &gmux_notify_handler);
+	if (ACPI_FAILURE(status)) {
+		printk("Install notify handler failed: %s\n", acpi_format_exception(status));
+	}
+	gmux_irq_cancel(gmux_data);
+err_notify:
+	gmux_cleanup(gmux_data);
+err_release:
+	release_region(gmux_data->iostart, gmux_data->iolen);
+err_free:
+	gmux_free(gmux_data);
+	return ret;
+}
+
+static void __devexit gmux_remove(struct pnp_dev *pnp)
+{
+	struct apple_gmux_data *gmux_data = pnp_get_drvdata(pnp);
+	acpi_status status;
+
+	gmux_unregister(gmux_data);
+	/* powers the GPU back up, which needs the power interrupt */
+	if (gmux_data->discrete)
+		gmux_teardown_runtime_pm(gmux_data->discrete);
+	/* the interrupt bottom half queues stages, stop it before the wq */
+	gmux_disable_interrupts(gmux_data);
+	status = acpi_remove_notify_handler(gmux_data->dhandle, ACPI_DEVICE_NOTIFY, &gmux_notify_handler);
+	if (ACPI_FAILURE(status)) {
+		printk("Install notify handler failed: %s\n", acpi_format_exception(status));
+	}
+	gmux_irq_cancel(gmux_data);
+	gmux_cleanup(gmux_data);
+	gmux_free_gpus(gmux_data);
+	release_region(gmux_data->iostart, gmux_data->iolen);
+	gmux_free(gmux_data);
+}
+
+static const struct pnp_device_id gmux_device_ids[] = {
 	{"APP000B", 0},
 	{"", 0}
 };
@@ -446,18 +3379,322 @@ static struct pnp_driver gmux_pnp_driver = {
 	.probe		= gmux_probe,
 	.remove		= __devexit_p(gmux_remove),
 	.id_table	= gmux_device_ids,
-	.suspend	= gmux_suspend,
-	.resume		= gmux_resume
+	.suspend	= gmux_pnp_suspend,
+	.resume		= gmux_pnp_resume
+};
+
+/*
+ * Emulated gmux, to exercise the driver without Apple hardware. Only the
+ * registers the driver uses are modelled: the muxes read back what was
+ * written to them, a power change completes emulate_power_delay ms after
+ * its sequence was written, and interrupts are delivered straight to
+ * gmux_notify_handler() as the ACPI notify would. The emulated gmux
+ * controls a single discrete GPU which has no PCI device, and is driven
+ * through sysfs and debugfs only, never through vga_switcheroo.
+ */
+struct gmux_emu {
+	struct apple_gmux_data *gmux_data;
+	spinlock_t lock;
+	u8 regs[GMUX_MIN_IO_LEN];
+	struct delayed_work power_work;
+	struct work_struct irq_work;
+};
+
+static struct platform_device *gmux_emu_pdev;
+
+static void gmux_emu_raise(struct gmux_emu *emu, int status)
+{
+	if (!emulate_irq ||
+	    (emulate_irq == 2 && status == GMUX_INTERRUPT_STATUS_POWER))
+		return;
+
+	emu->regs[GMUX_PORT_INTERRUPT_STATUS] |= status;
+	if (emu->regs[GMUX_PORT_INTERRUPT_ENABLE] & status)
+		schedule_work(&emu->irq_work);
+}
+
+static void gmux_emu_write(struct gmux_emu *emu, int port, u8 val)
+{
+	switch (port) {
+	case GMUX_PORT_SWITCH_DISPLAY:
+		emu->regs[GMUX_PORT_SWITCH_GET_DISPLAY] = val;
+		gmux_emu_raise(emu, GMUX_INTERRUPT_STATUS_DISPLAY);
+		break;
+	case GMUX_PORT_SWITCH_EXTERNAL:
+		emu->regs[GMUX_PORT_SWITCH_GET_EXTERNAL] = val;
+		break;
+	case GMUX_PORT_INTERRUPT_STATUS:
+		/* writing back the status acknowledges it */
+		emu->regs[port] &= ~val;
+		return;
+	case GMUX_PORT_INTERRUPT_ENABLE:
+		emu->regs[port] = val;
+		if (val & emu->regs[GMUX_PORT_INTERRUPT_STATUS])
+			schedule_work(&emu->irq_work);
+		return;
+	case GMUX_PORT_DISCRETE_POWER:
+		/* 3 and 0 finish the power up and power down sequences */
+		if (val == 3 || val == 0)
+			schedule_delayed_work(&emu->power_work,
+				msecs_to_jiffies(emulate_power_delay));
+		break;
+	}
+
+	emu->regs[port] = val;
+}
+
+static void gmux_emu_power_work_func(struct work_struct *work)
+{
+	struct gmux_emu *emu =
+		container_of(work, struct gmux_emu, power_work.work);
+
+	spin_lock_irq(&emu->lock);
+	gmux_emu_raise(emu, GMUX_INTERRUPT_STATUS_POWER);
+	spin_unlock_irq(&emu->lock);
+}
+
+static void gmux_emu_irq_work_func(struct work_struct *work)
+{
+	struct gmux_emu *emu = container_of(work, struct gmux_emu, irq_work);
+
+	gmux_notify_handler(NULL, 0x80, emu->gmux_data);
+}
+
+static u8 gmux_emu_read8(struct apple_gmux_data *gmux_data, int port)
+{
+	struct gmux_emu *emu = gmux_data->emu;
+	unsigned long flags;
+	u8 val;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	val = emu->regs[port];
+	spin_unlock_irqrestore(&emu->lock, flags);
+
+	return val;
+}
+
+static void gmux_emu_write8(struct apple_gmux_data *gmux_data, int port,
+			    u8 val)
+{
+	struct gmux_emu *emu = gmux_data->emu;
+	unsigned long flags;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	gmux_emu_write(emu, port, val);
+	spin_unlock_irqrestore(&emu->lock, flags);
+}
+
+static u32 gmux_emu_read32(struct apple_gmux_data *gmux_data, int port)
+{
+	struct gmux_emu *emu = gmux_data->emu;
+	unsigned long flags;
+	u32 val;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	val = emu->regs[port] | emu->regs[port + 1] << 8 |
+	      emu->regs[port + 2] << 16 | emu->regs[port + 3] << 24;
+	spin_unlock_irqrestore(&emu->lock, flags);
+
+	return val;
+}
+
+static void gmux_emu_write32(struct apple_gmux_data *gmux_data, int port,
+			     u32 val)
+{
+	struct gmux_emu *emu = gmux_data->emu;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	for (i = 0; i < 4; i++)
+		gmux_emu_write(emu, port + i, val >> (8 * i));
+	spin_unlock_irqrestore(&emu->lock, flags);
+}
+
+static const struct gmux_port_ops gmux_emu_ops = {
+	.name = "emulated",
+	.read8 = gmux_emu_read8,
+	.write8 = gmux_emu_write8,
+	.read32 = gmux_emu_read32,
+	.write32 = gmux_emu_write32,
+	.brightness_mask = GMUX_BRIGHTNESS_MASK,
+};
+
+/* Power-on state: IGD drives everything and the discrete GPU is on */
+static void gmux_emu_reset(struct gmux_emu *emu)
+{
+	u32 max = 110400;
+	int i;
+
+	emu->regs[GMUX_PORT_VERSION_MAJOR] = 1;
+	emu->regs[GMUX_PORT_VERSION_MINOR] = 9;
+	emu->regs[GMUX_PORT_VERSION_RELEASE] = 0;
+	emu->regs[GMUX_PORT_SWITCH_DISPLAY] = 2;
+	emu->regs[GMUX_PORT_SWITCH_GET_DISPLAY] = 2;
+	emu->regs[GMUX_PORT_SWITCH_DDC] = 1;
+	emu->regs[GMUX_PORT_SWITCH_EXTERNAL] = 2;
+	emu->regs[GMUX_PORT_SWITCH_GET_EXTERNAL] = 2;
+	emu->regs[GMUX_PORT_DISCRETE_POWER] = 3;
+	for (i = 0; i < 4; i++) {
+		emu->regs[GMUX_PORT_MAX_BRIGHTNESS + i] = max >> (8 * i);
+		emu->regs[GMUX_PORT_BRIGHTNESS + i] = (max / 2) >> (8 * i);
+	}
+}
+
+static int __devinit gmux_emu_probe(struct platform_device *pdev)
+{
+	struct apple_gmux_data *gmux_data;
+	struct gmux_emu *emu;
+	struct gmux_gpu *gpu;
+	int ret = -ENOMEM;
+
+	gmux_data = gmux_alloc(&pdev->dev);
+	if (!gmux_data)
+		return -ENOMEM;
+
+	emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+	if (!emu)
+		goto err_free;
+
+	emu->gmux_data = gmux_data;
+	spin_lock_init(&emu->lock);
+	INIT_DELAYED_WORK(&emu->power_work, gmux_emu_power_work_func);
+	INIT_WORK(&emu->irq_work, gmux_emu_irq_work_func);
+	gmux_emu_reset(emu);
+	gmux_data->emu = emu;
+	gmux_data->ops = &gmux_emu_ops;
+
+	ret = gmux_setup(gmux_data);
+	if (ret)
+		goto err_emu;
+
+	ret = -ENOMEM;
+	gpu = gmux_add_gpu(gmux_data, NULL);
+	if (!gpu)
+		goto err_setup;
+	gmux_data->discrete = gpu;
+
+	ret = gmux_register(gmux_data);
+	if (ret)
+		goto err_gpu;
+
+	dev_info(&pdev->dev, "emulated gmux registered\n");
+	return 0;
+
+err_gpu:
+	gmux_free_gpus(gmux_data);
+err_setup:
+	gmux_cleanup(gmux_data);
+err_emu:
+	kfree(emu);
+err_free:
+	gmux_free(gmux_data);
+	return ret;
+}
+
+static int __devexit gmux_emu_remove(struct platform_device *pdev)
+{
+	struct apple_gmux_data *gmux_data = platform_get_drvdata(pdev);
+	struct gmux_emu *emu = gmux_data->emu;
+
+	gmux_unregister(gmux_data);
+	/* powers the GPU back up, which needs the power interrupt */
+	if (gmux_data->discrete)
+		gmux_teardown_runtime_pm(gmux_data->discrete);
+	/* the interrupt bottom half queues stages, stop it before the wq */
+	gmux_disable_interrupts(gmux_data);
+	cancel_work_sync(&emu->irq_work);
+	gmux_irq_cancel(gmux_data);
+	gmux_cleanup(gmux_data);
+	gmux_free_gpus(gmux_data);
+	/*
+	 * the drained stages and a deferred power down run by
+	 * gmux_free_gpus() may have started a power change
+	 */
+	cancel_delayed_work_sync(&emu->power_work);
+	kfree(emu);
+	gmux_free(gmux_data);
+	return 0;
+}
+
+static int gmux_emu_suspend(struct platform_device *pdev, pm_message_t state)
+{
+	return gmux_suspend(platform_get_drvdata(pdev));
+}
+
+static int gmux_emu_resume(struct platform_device *pdev)
+{
+	return gmux_resume(platform_get_drvdata(pdev));
+}
+
+static struct platform_driver gmux_emu_driver = {
+	.probe		= gmux_emu_probe,
+	.remove		= __devexit_p(gmux_emu_remove),
+	.suspend	= gmux_emu_suspend,
+	.resume		= gmux_emu_resume,
+	.driver		= {
+		.name	= "apple-gmux-emu",
+	},
 };
 
+static int gmux_emu_init(void)
+{
+	int ret;
+
+	ret = platform_driver_register(&gmux_emu_driver);
+	if (ret)
+		return ret;
+
+	gmux_emu_pdev = platform_device_register_simple("apple-gmux-emu", -1,
+							NULL, 0);
+	if (IS_ERR(gmux_emu_pdev)) {
+		platform_driver_unregister(&gmux_emu_driver);
+		return PTR_ERR(gmux_emu_pdev);
+	}
+
+	return 0;
+}
+
+static void gmux_emu_exit(void)
+{
+	platform_device_unregister(gmux_emu_pdev);
+	platform_driver_unregister(&gmux_emu_driver);
+}
+
 static int __init apple_gmux_init(void)
 {
-	return pnp_register_driver(&gmux_pnp_driver);
+	int ret;
+
+	gmux_debugfs_root = debugfs_create_dir("apple_gmux", NULL);
+	if (IS_ERR(gmux_debugfs_root))
+		gmux_debugfs_root = NULL;
+
+	ret = pnp_register_driver(&gmux_pnp_driver);
+	if (ret)
+		goto err;
+
+	/* after the real gmux, which has to be the one driving switcheroo */
+	if (emulate) {
+		ret = gmux_emu_init();
+		if (ret) {
+			pnp_unregister_driver(&gmux_pnp_driver);
+			goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	debugfs_remove_recursive(gmux_debugfs_root);
+	return ret;
 }
 
 static void __exit apple_gmux_exit(void)
 {
+	if (emulate)
+		gmux_emu_exit();
 	pnp_unregister_driver(&gmux_pnp_driver);
+	debugfs_remove_recursive(gmux_debugfs_root);
 }
 
 module_init(apple_gmux_init);
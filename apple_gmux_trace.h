@@ -0,0 +1,162 @@
+/*
+ *  Tracepoints for the Apple gmux driver
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM apple_gmux
+
+#if !defined(_APPLE_GMUX_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _APPLE_GMUX_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(gmux_port,
+	TP_PROTO(int port, u32 val, int width),
+	TP_ARGS(port, val, width),
+
+	TP_STRUCT__entry(
+		__field(int, port)
+		__field(u32, val)
+		__field(int, width)
+	),
+
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->val = val;
+		__entry->width = width;
+	),
+
+	TP_printk("port=%#04x val=%#x width=%d",
+		  __entry->port, __entry->val, __entry->width)
+);
+
+DEFINE_EVENT(gmux_port, gmux_port_read,
+	TP_PROTO(int port, u32 val, int width),
+	TP_ARGS(port, val, width)
+);
+
+DEFINE_EVENT(gmux_port, gmux_port_write,
+	TP_PROTO(int port, u32 val, int width),
+	TP_ARGS(port, val, width)
+);
+
+TRACE_EVENT(gmux_pwrd,
+	TP_PROTO(int arg, int ret),
+	TP_ARGS(arg, ret),
+
+	TP_STRUCT__entry(
+		__field(int, arg)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->arg = arg;
+		__entry->ret = ret;
+	),
+
+	TP_printk("arg=%d ret=%d", __entry->arg, __entry->ret)
+);
+
+TRACE_EVENT(gmux_power_state,
+	TP_PROTO(int old_state, int new_state),
+	TP_ARGS(old_state, new_state),
+
+	TP_STRUCT__entry(
+		__field(int, old_state)
+		__field(int, new_state)
+	),
+
+	TP_fast_assign(
+		__entry->old_state = old_state;
+		__entry->new_state = new_state;
+	),
+
+	TP_printk("%d -> %d", __entry->old_state, __entry->new_state)
+);
+
+TRACE_EVENT(gmux_irq,
+	TP_PROTO(int status),
+	TP_ARGS(status),
+
+	TP_STRUCT__entry(
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		__entry->status = status;
+	),
+
+	TP_printk("status=%#x", __entry->status)
+);
+
+TRACE_EVENT(gmux_switch_begin,
+	TP_PROTO(int id, bool prepared),
+	TP_ARGS(id, prepared),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(bool, prepared)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->prepared = prepared;
+	),
+
+	TP_printk("id=%d prepared=%d", __entry->id, __entry->prepared)
+);
+
+TRACE_EVENT(gmux_switch_end,
+	TP_PROTO(int id, u8 display, s64 us),
+	TP_ARGS(id, display, us),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u8, display)
+		__field(s64, us)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->display = display;
+		__entry->us = us;
+	),
+
+	TP_printk("id=%d display=%#x us=%lld",
+		  __entry->id, __entry->display, __entry->us)
+);
+
+TRACE_EVENT(gmux_xfer,
+	TP_PROTO(const char *name, int nr, int ret, s64 ns),
+	TP_ARGS(name, nr, ret, ns),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(int, nr)
+		__field(int, ret)
+		__field(s64, ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->nr = nr;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+
+	TP_printk("%s ops=%d ret=%d ns=%lld", __get_str(name),
+		  __entry->nr, __entry->ret, __entry->ns)
+);
+
+#endif /* _APPLE_GMUX_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE apple_gmux_trace
+
+#include <trace/define_trace.h>